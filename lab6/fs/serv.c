@@ -30,6 +30,9 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 #define REQVA		0x0ffff000
 
+// Pages to grant a client with the reply to a map request.
+struct Ipcgrant grants[MAXFILESIZE / BLKSIZE];
+
 void
 serve_init(void)
 {
@@ -78,11 +81,14 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
-// Serve requests, sending responses back to envid.
-// To send a result back, ipc_send(envid, r, 0, 0).
-// To include a page, ipc_send(envid, r, srcva, perm).
-void
-serve_open(envid_t envid, struct Fsreq_open *rq)
+// Serve requests from envid.  Each returns the result to send back;
+// serve() sends it with the next ipc_reply_recv.
+// To include a page, store it and its permissions in *pg_store and
+// *perm_store.  To map several pages, fill in grants[] and store
+// their number in *ngrant_store.
+int
+serve_open(envid_t envid, struct Fsreq_open *rq, void **pg_store,
+	   int *perm_store)
 {
 	char path[MAXPATHLEN];
 	struct File *f;
@@ -124,13 +130,14 @@ serve_open(envid_t envid, struct Fsreq_open *rq)
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
-	ipc_send(envid, 0, o->o_fd, PTE_P|PTE_U|PTE_W|PTE_SHARE);
-	return;
+	*pg_store = o->o_fd;
+	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
+	return 0;
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
+int
 serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 {
 	struct OpenFile *o;
@@ -170,7 +177,7 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 	// Here's how it goes.
 
 	// First, use openfile_lookup to find the relevant open file.
-	// On failure, return the error code to the client with ipc_send.
+	// On failure, return the error code to the client.
 	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
 		goto out;
 
@@ -186,11 +193,11 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *rq)
 	// Finally, return to the client!
 	// (We just return r since we know it's 0 at this point.)
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
-serve_map(envid_t envid, struct Fsreq_map *rq)
+int
+serve_map(envid_t envid, struct Fsreq_map *rq, int *ngrant_store)
 {
 	int r;
 	char *blk;
@@ -198,41 +205,52 @@ serve_map(envid_t envid, struct Fsreq_map *rq)
 	int perm;
 
 	if (debug)
-		cprintf("serve_map %08x %08x %08x\n", envid, rq->req_fileid, rq->req_offset);
+		cprintf("serve_map %08x %08x %08x %08x\n", envid, rq->req_fileid,
+			rq->req_offset, rq->req_len);
 
-	// Map the requested block in the client's address space
-	// by using ipc_send.
+	// Map the requested blocks in the client's address space
+	// by granting them with the reply.
 	// Map read-only unless the file's open mode (o->o_mode) allows writes
 	// (see the O_ flags in inc/lib.h).
 	
 	// LAB 5: Your code here.
 	//panic("serve_map not implemented");
-	uint32_t blkno;
-	blkno = rq->req_offset / BLKSIZE;
+	uint32_t blkno, n;
 	if ((r=openfile_lookup(envid, rq->req_fileid, &o)) < 0)
 		goto out;
-	if ((r=file_get_block(o->o_file, blkno, &blk)) < 0)
+	if (rq->req_offset < 0 || rq->req_offset % BLKSIZE || rq->req_len <= 0
+	    || rq->req_len > MAXFILESIZE - rq->req_offset) {
+		r = -E_INVAL;
 		goto out;
-	if (blkno < NDIRECT)
-		o->o_fd->fd_file.file.f_direct[blkno] = o->o_file->f_direct[blkno];
-	else
-		o->o_fd->fd_file.file.f_indirect = o->o_file->f_indirect;
+	}
 
 	if ((o->o_mode & O_WRONLY) || (o->o_mode & O_RDWR))
 		perm = PTE_W;
 	else
 		perm = 0;
 
-	// Here PTE_SHARE is added for lab 6
-	ipc_send(envid, r, blk, perm|PTE_U|PTE_P|PTE_SHARE);
-	return;
+	for (n = 0; n * BLKSIZE < rq->req_len; n++) {
+		blkno = rq->req_offset / BLKSIZE + n;
+		if ((r=file_get_block(o->o_file, blkno, &blk)) < 0)
+			goto out;
+		if (blkno < NDIRECT)
+			o->o_fd->fd_file.file.f_direct[blkno] = o->o_file->f_direct[blkno];
+		else
+			o->o_fd->fd_file.file.f_indirect = o->o_file->f_indirect;
+
+		// Here PTE_SHARE is added for lab 6
+		grants[n].g_srcva = blk;
+		grants[n].g_dstoff = n * BLKSIZE;
+		grants[n].g_perm = perm|PTE_U|PTE_P|PTE_SHARE;
+	}
+	*ngrant_store = n;
+	return 0;
 	
 out:
-	ipc_send(envid, r, 0, 0);
-	
+	return r;
 }
 
-void
+int
 serve_close(envid_t envid, struct Fsreq_close *rq)
 {
 	struct OpenFile *o;
@@ -248,14 +266,13 @@ serve_close(envid_t envid, struct Fsreq_close *rq)
 	if ((r=openfile_lookup(envid, rq->req_fileid, &o)) < 0)
 		goto out;
 	file_close(o->o_file);
-	ipc_send(envid, 0, 0, 0);
-	return;
+	return 0;
 
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
+int
 serve_remove(envid_t envid, struct Fsreq_remove *rq)
 {
 	char path[MAXPATHLEN];
@@ -275,15 +292,13 @@ serve_remove(envid_t envid, struct Fsreq_remove *rq)
 	if ((r=file_remove(path)) < 0)
 		goto out;
 
-	ipc_send(envid, 0, 0, 0);
-	return;
+	return 0;
 
 out:
-	ipc_send(envid, r, 0, 0);
-
+	return r;
 }
 
-void
+int
 serve_dirty(envid_t envid, struct Fsreq_dirty *rq)
 {
 	struct OpenFile *o;
@@ -302,67 +317,98 @@ serve_dirty(envid_t envid, struct Fsreq_dirty *rq)
 	if ((r=file_dirty(o->o_file, rq->req_offset)) < 0)
 		goto out;
 
-	ipc_send(envid, 0, 0, 0);
-	return;
+	return 0;
 
 out:
-	ipc_send(envid, r, 0, 0);
+	return r;
 }
 
-void
+int
 serve_sync(envid_t envid)
 {
 	fs_sync();
-	ipc_send(envid, 0, 0, 0);
+	return 0;
 }
 
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm;
-	
+	uint32_t req, words[IPC_NWORDS];
+	envid_t whom;
+	int perm, pgperm, ngrant, r, i;
+	void *pg, *rq;
+
+	// Each reply goes out with the system call that waits for the
+	// next request, so a client's ipc_call costs the server a
+	// single trap.  whom is 0 when there is no one to reply to.
+	whom = 0;
+	r = pgperm = 0;
+	pg = NULL;
 	while (1) {
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, (void *) REQVA, &perm);
+		if (whom)
+			req = ipc_reply_recv(whom, r, pg, pgperm,
+					     &whom, (void *) REQVA, &perm);
+		else
+			req = ipc_recv(&whom, (void *) REQVA, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, vpt[VPN(REQVA)], REQVA);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		pg = NULL;
+		pgperm = 0;
+		ngrant = 0;
+
+		// Small requests come in the message words; all others
+		// must contain an argument page.
+		if (perm & PTE_P)
+			rq = (void *) REQVA;
+		else if (FSREQ_WORDS(req)) {
+			for (i = 0; i < IPC_NWORDS; i++)
+				words[i] = env->env_ipc_words[i];
+			rq = words;
+		} else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		switch (req) {
 		case FSREQ_OPEN:
-			serve_open(whom, (struct Fsreq_open*)REQVA);
+			r = serve_open(whom, (struct Fsreq_open*)rq,
+				       &pg, &pgperm);
 			break;
 		case FSREQ_MAP:
-			serve_map(whom, (struct Fsreq_map*)REQVA);
+			r = serve_map(whom, (struct Fsreq_map*)rq, &ngrant);
 			break;
 		case FSREQ_SET_SIZE:
-			serve_set_size(whom, (struct Fsreq_set_size*)REQVA);
+			r = serve_set_size(whom, (struct Fsreq_set_size*)rq);
 			break;
 		case FSREQ_CLOSE:
-			serve_close(whom, (struct Fsreq_close*)REQVA);
+			r = serve_close(whom, (struct Fsreq_close*)rq);
 			break;
 		case FSREQ_DIRTY:
-			serve_dirty(whom, (struct Fsreq_dirty*)REQVA);
+			r = serve_dirty(whom, (struct Fsreq_dirty*)rq);
 			break;
 		case FSREQ_REMOVE:
-			serve_remove(whom, (struct Fsreq_remove*)REQVA);
+			r = serve_remove(whom, (struct Fsreq_remove*)rq);
 			break;
 		case FSREQ_SYNC:
-			serve_sync(whom);
+			r = serve_sync(whom);
 			break;
 		default:
 			cprintf("Invalid request code %d from %08x\n", whom, req);
+			whom = 0;
 			break;
 		}
-		sys_page_unmap(0, (void*) REQVA);
+		if (perm & PTE_P)
+			sys_page_unmap(0, (void*) REQVA);
+
+		// A reply granting pages goes out on its own; if that
+		// fails, the client gets the error instead.
+		if (ngrant > 0 && (r = sys_ipc_grant(whom, 0, grants, ngrant)) == 0)
+			whom = 0;
 	}
 }
 
@@ -370,6 +416,10 @@ void
 umain(void)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert(sizeof(struct Fsreq_set_size) <= sizeof(env->env_ipc_words));
+	static_assert(sizeof(struct Fsreq_dirty) <= sizeof(env->env_ipc_words));
+	static_assert(sizeof(struct Fsreq_map) <= sizeof(env->env_ipc_words));
+	static_assert(MAXFILESIZE / BLKSIZE <= IPC_MAXGRANT);
         binaryname = "fs";
 	cprintf("FS is running\n");
 
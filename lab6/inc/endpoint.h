@@ -0,0 +1,33 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_ENDPOINT_H
+#define JOS_INC_ENDPOINT_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// An endpoint is a kernel message queue with a single receiver, the
+// environment that created it.  Any environment may post to it without
+// blocking, until its ring of EP_RING messages is full, and the receiver
+// takes out as many messages per system call as it has room for.
+//
+// Endpoint IDs are built like envids: the low LOG2NEP bits index the
+// kernel's endpoint table, and the rest tell apart the endpoints that
+// have used the same slot.
+typedef int32_t epid_t;
+
+#define LOG2NEP		6
+#define NEP		(1 << LOG2NEP)
+#define EPX(epid)	((epid) & (NEP - 1))
+
+// Messages an endpoint holds; must be a power of 2.
+#define EP_RING		32
+
+// A message, as the receiver gets it.
+struct Epmsg {
+	envid_t m_from;			// envid of the sender
+	uint32_t m_value;		// value sent
+	uint32_t m_words[IPC_NWORDS];	// words sent with it
+};
+
+#endif /* !JOS_INC_ENDPOINT_H */
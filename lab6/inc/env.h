@@ -12,28 +12,83 @@ typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+-----------16-----------+-------------15--------------+
+// |0|       Uniqueifier      |     Environment Index       |
+// | |                        |                             |
+// +--------------------------+-----------------------------+
+//                             \-------- ENVX(eid) --------/
 //
 // The environment index ENVX(eid) equals the environment's offset in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
 //
+// The envs[] array only grows as far as it has to: envs[i] is mapped
+// once environment i has been allocated at least once.
+//
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+#define LOG2NENV		15
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// The file server is the first environment the kernel creates.
+#define ENVX_FS			0
+
+// Number of words an IPC message can carry after its value.
+// They travel in system call argument registers, so a message made
+// only of words needs no page to be mapped.
+#define IPC_NWORDS		3
+
+// Most pages one sys_ipc_grant can map.
+#define IPC_MAXGRANT		(PTSIZE / PGSIZE)
+
+// One page of a sys_ipc_grant: the sender's page at g_srcva is mapped
+// g_dstoff bytes into the receiver's window, with permissions g_perm.
+struct Ipcgrant {
+	void *g_srcva;
+	uint32_t g_dstoff;
+	int g_perm;
+};
+
+// An environment's memory use, as reported by sys_env_memstat.
+// Lazily allocated pages (see sys_page_alloc) are committed, but not
+// resident until first written.
+struct Envmem {
+	uint32_t em_committed;	// Pages mapped below UTOP, or swapped out
+	uint32_t em_resident;	// Of those, pages with a frame behind them
+};
+
 // Values of env_status in struct Env
 #define ENV_FREE		0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
+#define ENV_DYING		3	// destroyed while running on another CPU
+
+// Scheduling priorities.  The scheduler always runs an env from the
+// highest nonempty priority level, round-robin within a level.
+#define NPRIO			8
+#define ENV_PRIO_MIN		0
+#define ENV_PRIO_NORMAL		4
+#define ENV_PRIO_MAX		(NPRIO - 1)
+
+// Proportional-share (stride) scheduling within a priority level.
+// Each quantum of CPU time an env uses advances its pass by
+// STRIDE1 / env_shares, and the runnable env with the lowest pass runs
+// next, so over time envs at the same level receive CPU in proportion
+// to their shares.  The environments the kernel creates start with
+// ENV_SHARES_MAX, and children inherit their parent's shares, so an
+// environment can be given more than its siblings as well as less.
+#define STRIDE1			(1 << 20)
+#define ENV_SHARES_MAX		10000
+
+// Environments blocked in sys_ipc_send to the same receiver.
+TAILQ_HEAD(Env_ipcq, Env);
+
+// Environments blocked until the same environment exits: in
+// sys_env_wait, or waiting for its reply to a sys_ipc_call.
+LIST_HEAD(Env_waitq, Env);
 
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
@@ -43,6 +98,18 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 
+	// Scheduling
+	uint16_t env_prio;		// Priority, ENV_PRIO_MIN..ENV_PRIO_MAX
+	uint16_t env_runq_cpu;		// CPU whose run queue holds this env
+	TAILQ_ENTRY(Env) env_runq_link;	// Run queue link pointers
+	uint32_t env_shares;		// CPU shares, 1..ENV_SHARES_MAX
+	uint32_t env_pass;		// Stride scheduler virtual time
+	int env_cpunum;			// CPU running this env, or -1
+
+	// Timer (see kern/timer.c)
+	uint64_t env_timeout;		// Deadline in msec, or 0 if none
+	LIST_ENTRY(Env) env_timer_link;	// Timer wheel link pointers
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
@@ -53,9 +120,28 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// env is blocked receiving
 	void *env_ipc_dstva;		// va at which to map received page
+	void *env_ipc_winva;		// window for pages granted to us
+	uint32_t env_ipc_winlen;	// its length; 0 if no window
 	uint32_t env_ipc_value;		// data value sent to us 
+	uint32_t env_ipc_words[IPC_NWORDS]; // words sent with it, or zeros
 	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
+	envid_t env_ipc_recvfrom;	// if nonzero, only accept sends from it
+
+	// Blocking send (sys_ipc_send)
+	envid_t env_ipc_sendto;		// env we are blocked sending to, or 0
+	uint32_t env_ipc_sendval;	// value we are sending
+	uint32_t env_ipc_sendwords[IPC_NWORDS]; // words sent with it
+	void *env_ipc_sendva;		// page we are sending, if < UTOP
+	int env_ipc_sendperm;		// perm of that page
+	bool env_ipc_calling;		// sys_ipc_call: await a reply once sent
+	TAILQ_ENTRY(Env) env_ipc_link;	// Link in the receiver's env_ipc_senders
+	struct Env_ipcq env_ipc_senders; // Envs blocked sending to us, in order
+	int32_t env_ep_recving;		// Endpoint we are blocked on, or 0
+
+	// Waiting for an env to exit (sys_env_wait) or reply (sys_ipc_call)
+	LIST_ENTRY(Env) env_wait_link;	// Link in its env_waiters, if waiting
+	struct Env_waitq env_waiters;	// Envs waiting for us
 };
 
 #endif // !JOS_INC_ENV_H
@@ -73,14 +73,23 @@ struct Super {
 #define FSREQ_REMOVE	6
 #define FSREQ_SYNC	7
 
+// Requests small enough to travel in the IPC message words, rather
+// than in a request page.
+#define FSREQ_WORDS(req)	((req) == FSREQ_MAP || (req) == FSREQ_SET_SIZE \
+				 || (req) == FSREQ_CLOSE || (req) == FSREQ_DIRTY \
+				 || (req) == FSREQ_SYNC)
+
 struct Fsreq_open {
 	char req_path[MAXPATHLEN];
 	int req_omode;
 };
 
+// Map the blocks in [req_offset, req_offset+req_len) of a file;
+// req_offset must be block-aligned.
 struct Fsreq_map {
 	int req_fileid;
 	off_t req_offset;
+	off_t req_len;
 };
 
 struct Fsreq_set_size {
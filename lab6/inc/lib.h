@@ -21,6 +21,8 @@
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/malloc.h>
+#include <inc/time.h>
+#include <inc/endpoint.h>
 
 #define USED(x)		(void)(x)
 
@@ -29,6 +31,7 @@ extern char *binaryname;
 extern volatile struct Env *env;
 extern volatile struct Env envs[NENV];
 extern volatile struct Page pages[];
+extern volatile struct Timepage vtime;
 void	exit(void);
 
 // pgfault.c
@@ -43,16 +46,42 @@ int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+int	sys_yield_to(envid_t env);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_memstat(envid_t env, struct Envmem *em);
+int	sys_env_wait(envid_t env);
+int	sys_merge_stat(int on, struct Mergestat *ms);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(const struct Pageop *ops, unsigned n, int *status);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_call_words(envid_t to_env, uint32_t value, uint32_t w1,
+			   uint32_t w2, uint32_t w3);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_window(void *va, size_t len);
+int	sys_ipc_grant(envid_t to_env, uint32_t value,
+		      const struct Ipcgrant *grants, unsigned n);
+epid_t	sys_ep_create(void);
+int	sys_ep_destroy(epid_t epid);
+int	sys_ep_post(epid_t epid, uint32_t value, uint32_t w1, uint32_t w2,
+		    uint32_t w3);
+int	sys_ep_recv(epid_t epid, struct Epmsg *msgs, unsigned n);
+int	sys_ipc_recv_timeout(void *rcv_pg, unsigned msec);
+int	sys_env_set_priority(envid_t env, uint32_t prio);
+int	sys_env_set_shares(envid_t env, uint32_t shares);
+int	sys_sleep(unsigned msec);
+unsigned sys_time_msec(void);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t sys_exofork(void) __attribute__((always_inline));
@@ -71,10 +100,24 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 unsigned msec);
+int32_t ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_call_words(envid_t to_env, uint32_t val, uint32_t w1, uint32_t w2,
+		       uint32_t w3);
+int	ep_recv(epid_t epid, struct Epmsg *msgs, unsigned n);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+
+// time.c
+uint64_t time_nsec(void);
+uint64_t time_msec(void);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
+envid_t	ufork_unbatched(void);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -97,7 +140,7 @@ int	sync(void);
 
 // fsipc.c
 int	fsipc_open(const char *path, int omode, struct Fd *fd);
-int	fsipc_map(int fileid, off_t offset, void *dst_va);
+int	fsipc_map(int fileid, off_t offset, off_t len, void *dst_va);
 int	fsipc_set_size(int fileid, off_t size);
 int	fsipc_close(int fileid);
 int	fsipc_dirty(int fileid, off_t offset);
@@ -107,6 +150,20 @@ int	fsipc_sync(void);
 // pageref.c
 int	pageref(void *addr);
 
+// pagebatch.c
+#define PAGEBATCH_MAX	64
+struct Pagebatch {
+	struct Pageop pb_ops[PAGEBATCH_MAX];
+	int pb_n;
+	int pb_err;		// First error from a flush when full
+	int pb_max;		// Flush at this many ops; 0 means PAGEBATCH_MAX
+};
+void	batch_page_alloc(struct Pagebatch *b, envid_t env, void *pg, int perm);
+void	batch_page_map(struct Pagebatch *b, envid_t src_env, void *src_pg,
+		       envid_t dst_env, void *dst_pg, int perm);
+void	batch_page_unmap(struct Pagebatch *b, envid_t env, void *pg);
+int	batch_flush(struct Pagebatch *b);
+
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
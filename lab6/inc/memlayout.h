@@ -17,7 +17,7 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS    0x28     // Task segment selector
+#define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -36,22 +36,35 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     :              .               :                   |
+ *    MMIOLIM ------>  +------------------------------+ 0xef800000      --+
+ *                     |       Memory-mapped I/O      | RW/--  PTSIZE
+ *    MMIOBASE ----->  +------------------------------+ 0xef400000
+ *                     |     Env Table (Kern. RW)     | RW/--  ENVSIZE
+ *    ULIM, KENVS -->  +------------------------------+ 0xeec00000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
- *    UVPT      ---->  +------------------------------+ 0xef400000
+ *    UVPT      ---->  +------------------------------+ 0xee800000
  *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *    UPAGES    ---->  +------------------------------+ 0xee400000
+ *                     |         RO Time Page         | R-/R-  PGSIZE
+ *    UTIME     ---->  +------------------------------+ 0xee3ff000
+ *                     |           RO ENVS            | R-/R-  ENVSIZE-PGSIZE
+ * UTOP,UENVS ------>  +------------------------------+ 0xedc00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xedbff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xedbfe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xedbfd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -94,7 +107,18 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
-#define ULIM		(KSTACKTOP - PTSIZE) 
+#define KSTKGAP		(8*PGSIZE)   		// size of a kernel stack guard
+
+// Memory-mapped I/O (the local and I/O APICs).
+#define MMIOLIM		(KSTACKTOP - PTSIZE)
+#define MMIOBASE	(MMIOLIM - PTSIZE)
+
+// The env table, mapped a page at a time as it grows, and the same
+// pages read-only for users at UENVS.
+#define ENVSIZE		(2*PTSIZE)
+#define KENVS		(MMIOBASE - ENVSIZE)
+
+#define ULIM		(KENVS)
 
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
@@ -105,8 +129,10 @@
 #define UVPT		(ULIM - PTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
-// Read-only copies of the global env structures
-#define UENVS		(UPAGES - PTSIZE)
+// Read-only kernel clock (struct Timepage, see inc/time.h)
+#define UTIME		(UPAGES - PGSIZE)
+// Read-only copies of the global env structures, below UTIME
+#define UENVS		(UPAGES - ENVSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -131,6 +157,10 @@
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)	
 
+// Physical address where the application processors' boot code is
+// copied (kern/mpentry.S).  Must be page aligned and below 1MB.
+#define MPENTRY_PADDR	0x7000
+
 
 #ifndef __ASSEMBLER__
 
@@ -173,8 +203,17 @@ struct Page {
 	// to this page, for pages allocated using page_alloc.
 	// Pages allocated at boot time using pmap.c's
 	// boot_alloc do not have valid reference count fields.
+	// It is 32 bits wide since every lazily allocated page maps the
+	// one zero page, and 16 bits would soon wrap.
+
+	uint32_t pp_ref;
 
-	uint16_t pp_ref;
+	// The buddy allocator's state: pp_free is set on the first page
+	// of each free block, and pp_order is that block's order (the
+	// block is 2^pp_order pages long).  The first page of an
+	// allocated block keeps its order too, so page_free frees it whole.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
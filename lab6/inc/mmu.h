@@ -65,11 +65,18 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global
 #define PTE_MBZ		0x180	// Bits must be zero
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user
+// processes are allowed to set them arbitrarily.  The kernel gives them
+// a meaning: it resolves write faults on PTE_COW pages itself, sys_fork
+// leaves PTE_SHARE pages shared with the child, and a PTE with PTE_SWAP
+// but not PTE_P stands for a page the kernel has written out to swap.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_SWAP	0x200	// Swapped out (when PTE_P is clear)
+#define PTE_SHARE	0x400	// Shared across fork and spawn
+#define PTE_COW		0x800	// Copy-on-write
 
 // Only flags in PTE_USER may be used in system calls.
 #define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
@@ -77,6 +84,17 @@
 // address in page table entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// A swapped-out page's PTE keeps the page's flags, less PTE_P, and holds
+// the number of its swap slot where the address would be.
+#define PTE_SWAPPED(pte)	(((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+#define PTE_SWAPSLOT(pte)	((uint32_t) (pte) >> PGSHIFT)
+
+// A page directory entry with PTE_PS set maps a whole PTSIZE superpage
+// (with CR4_PSE on) instead of pointing to a page table.  Its low bits
+// are the same flags as a PTE's.  vpt[] shows the superpage's contents,
+// not PTEs, so check vpd[] for PTE_PS first.
+#define PDE_PS_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -91,6 +109,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum
 {
@@ -18,7 +20,55 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_env_set_priority,
+	SYS_env_set_shares,
+	SYS_sleep,
+	SYS_time_msec,
+	SYS_yield_to,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_call_words,
+	SYS_ipc_reply_recv,
+	SYS_ipc_window,
+	SYS_ipc_grant,
+	SYS_ep_create,
+	SYS_ep_destroy,
+	SYS_ep_post,
+	SYS_ep_recv,
+	SYS_page_batch,
+	SYS_fork,
+	SYS_env_memstat,
+	SYS_env_wait,
+	SYS_merge_stat,
 	NSYSCALLS
 };
 
+// Operations for sys_page_batch, each done as by the system call of
+// the same name.
+enum {
+	PAGEOP_ALLOC = 1,	// sys_page_alloc(op_env, op_va, op_perm)
+	PAGEOP_MAP,		// sys_page_map(op_env, op_va, op_dstenv,
+				//	op_dstva, op_perm)
+	PAGEOP_UNMAP,		// sys_page_unmap(op_env, op_va)
+};
+
+struct Pageop {
+	int op_type;
+	int32_t op_env;		// an envid_t
+	void *op_va;
+	int32_t op_dstenv;	// an envid_t
+	void *op_dstva;
+	int op_perm;
+};
+
+// Same-page merging's state, from sys_merge_stat.  The counts are since
+// the kernel monitor last reset them.
+struct Mergestat {
+	bool ms_on;		// Off at boot
+	uint32_t ms_npass;	// Passes finished
+	uint32_t ms_nscan;	// Pages hashed
+	uint32_t ms_nmerged;	// Pages merged into a shared frame
+	uint32_t ms_nzero;	// Pages of zeros mapped to the zero page
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,21 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The kernel's clock, mapped read-only into every environment at UTIME
+// so that user code can tell the time without a system call.
+//
+// Time since boot is the TSC scaled to nanoseconds:
+//	ns = ((tsc - tp_boot_tsc) * tp_mult) >> tp_shift
+// The kernel makes tp_seq odd while it updates the page, so a reader
+// must retry if tp_seq was odd, or changed, while it read the rest.
+struct Timepage {
+	uint32_t tp_seq;	// Update sequence counter
+	uint32_t tp_mult;	// Nanoseconds per TSC cycle << tp_shift
+	uint32_t tp_shift;
+	uint32_t tp_tsc_khz;	// TSC frequency; 0 until calibrated
+	uint64_t tp_boot_tsc;	// TSC at boot
+};
+
+#endif /* !JOS_INC_TIME_H */
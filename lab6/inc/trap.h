@@ -34,6 +34,8 @@
 #define IRQ_KBD          1
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_TLBFLUSH    20	// inter-processor TLB shootdown
+#define IRQ_WAKEUP      21	// inter-processor: look for work
 #define IRQ_SPURIOUS    31
 
 #ifndef __ASSEMBLER__
@@ -34,6 +34,8 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
+static __inline void pause(void) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +276,23 @@ read_tsc(void)
         return tsc;
 }
 
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	__asm __volatile("lock; xchgl %0, %1" :
+			 "+m" (*addr), "=a" (result) :
+			 "1" (newval) :
+			 "cc");
+	return result;
+}
+
+static __inline void
+pause(void)
+{
+	__asm __volatile("pause" : : : "memory");
+}
+
 #endif /* !JOS_INC_X86_H */
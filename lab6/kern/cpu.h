@@ -0,0 +1,80 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Maximum number of CPUs
+#define NCPU	8
+
+// Values of cpu_status in struct Cpu
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+// Per-CPU state
+struct Cpu {
+	uint8_t cpu_id;			// Index into cpus[]
+	uint8_t cpu_apicid;		// Local APIC ID
+	volatile uint32_t cpu_status;	// The status of the CPU
+	struct Env *cpu_env;		// The currently-running environment
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+	volatile uint32_t cpu_tlbflush;	// Set while a TLB shootdown is pending
+
+	// TLB shootdowns deferred by tlb_batch_begin
+	bool cpu_tlbbatch;		// Deferring?
+	pde_t *cpu_tlbpgdir;		// Address space owed one, or NULL
+
+	// TLB flush counts, since the kernel monitor last reset them
+	uint32_t cpu_nflush;		// Whole-TLB flushes, %cr3 loads included
+	uint32_t cpu_ninvlpg;		// Single-page invalidations
+	uint32_t cpu_nshootdown;	// Shootdown IPIs sent
+	uint32_t cpu_ncr3skip;		// %cr3 loads skipped by env_run
+	uint64_t cpu_timer;		// When the armed timer fires, or 0
+	uint64_t cpu_run_start;		// timer_usec when curenv was last charged
+
+	// Idle time accounting, in TSC cycles
+	uint64_t cpu_idle_start;	// When the CPU went idle, or 0 if busy
+	uint64_t cpu_idle_tsc;		// Total idle time
+	uint64_t cpu_idle_mark;		// cpu_idle_tsc at the last report
+	uint64_t cpu_idle_marktime;	// TSC at the last report
+};
+
+// Initialized in mpconfig.c
+extern struct Cpu cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct Cpu *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+extern physaddr_t ioapicaddr;		// Physical MMIO address of the I/O APIC
+extern bool ismp;			// Found an MP or ACPI table?
+extern volatile uint32_t *lapic;	// Mapped local APIC, or NULL
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
+
+// Top of CPU i's kernel stack in the KSTACKTOP region
+#define KSTACKTOP_CPU(i)	(KSTACKTOP - (i) * (KSTKSIZE + KSTKGAP))
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(uint8_t apicid, int vector);
+uint32_t lapic_timer_oneshot(uint32_t msec);
+void lapic_timer_stop(void);
+void ioapic_init(void);
+void ioapic_setmask(uint16_t mask);
+
+#endif
@@ -0,0 +1,151 @@
+// IPC endpoints: bounded, asynchronous message queues.
+//
+// Unlike sys_ipc_send, which hands one message straight to a waiting
+// receiver, posting to an endpoint only copies the message into the
+// endpoint's ring, so senders never wait for the receiver, and a
+// server can take a batch of requests from many clients at once.
+// Like the rest of the kernel's state, endpoints are protected by the
+// big kernel lock.
+
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/endpoint.h>
+#include <kern/env.h>
+
+struct Endpoint {
+	epid_t ep_id;			// Kept when freed, for the next ID
+	envid_t ep_owner;		// The receiver; 0 if the slot is free
+	uint32_t ep_head;		// Next message to receive
+	uint32_t ep_tail;		// Next free slot; both run freely
+	struct Epmsg ep_ring[EP_RING];
+};
+
+static struct Endpoint endpoints[NEP];
+
+// Look up a live endpoint by ID.
+static struct Endpoint *
+ep_lookup(epid_t epid)
+{
+	struct Endpoint *ep;
+
+	if (epid <= 0)
+		return NULL;
+	ep = &endpoints[EPX(epid)];
+	if (ep->ep_owner == 0 || ep->ep_id != epid)
+		return NULL;
+	return ep;
+}
+
+// Create an endpoint that 'owner' receives from.
+// Returns its ID, or -E_NO_MEM if the endpoint table is full.
+int
+ep_alloc(struct Env *owner)
+{
+	struct Endpoint *ep;
+	int32_t generation;
+
+	for (ep = endpoints; ep < endpoints + NEP; ep++)
+		if (ep->ep_owner == 0)
+			break;
+	if (ep == endpoints + NEP)
+		return -E_NO_MEM;
+
+	generation = (ep->ep_id + NEP) & ~(NEP - 1);
+	if (generation <= 0)	// Don't create a negative epid.
+		generation = NEP;
+	ep->ep_id = generation | (ep - endpoints);
+	ep->ep_owner = owner->env_id;
+	ep->ep_head = ep->ep_tail = 0;
+	return ep->ep_id;
+}
+
+static void
+ep_free(struct Endpoint *ep)
+{
+	ep->ep_owner = 0;
+	ep->ep_head = ep->ep_tail = 0;
+}
+
+// Destroy an endpoint, dropping any messages still in it.
+// Only the owner may destroy an endpoint.
+// Returns 0 on success, -E_INVAL if epid is not an endpoint of owner's.
+int
+ep_destroy(struct Env *owner, epid_t epid)
+{
+	struct Endpoint *ep;
+
+	if ((ep = ep_lookup(epid)) == NULL || ep->ep_owner != owner->env_id)
+		return -E_INVAL;
+	ep_free(ep);
+	return 0;
+}
+
+// Destroy every endpoint that e owns; e is being freed.
+void
+ep_free_env(struct Env *e)
+{
+	struct Endpoint *ep;
+
+	for (ep = endpoints; ep < endpoints + NEP; ep++)
+		if (ep->ep_owner && ep->ep_owner == e->env_id)
+			ep_free(ep);
+}
+
+// Add a message from 'src' to the endpoint, waking its owner if it is
+// waiting in ep_recv.  'words' may be null to send only zeros.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if epid is not an endpoint.
+//	-E_EP_FULL if the endpoint already holds EP_RING messages.
+int
+ep_post(struct Env *src, epid_t epid, uint32_t value, const uint32_t *words)
+{
+	struct Endpoint *ep;
+	struct Epmsg *m;
+	struct Env *owner;
+
+	if ((ep = ep_lookup(epid)) == NULL)
+		return -E_INVAL;
+	if (ep->ep_tail - ep->ep_head == EP_RING)
+		return -E_EP_FULL;
+
+	m = &ep->ep_ring[ep->ep_tail++ % EP_RING];
+	m->m_from = src->env_id;
+	m->m_value = value;
+	if (words)
+		memmove(m->m_words, words, sizeof(m->m_words));
+	else
+		memset(m->m_words, 0, sizeof(m->m_words));
+
+	// Wake the owner; its sys_ep_recv returns 0, and it will try
+	// again.
+	if (envid2env(ep->ep_owner, &owner, 0) == 0
+	    && owner->env_ep_recving == epid) {
+		owner->env_ep_recving = 0;
+		owner->env_tf.tf_regs.reg_eax = 0;
+		env_set_status(owner, ENV_RUNNABLE);
+	}
+	return 0;
+}
+
+// Move up to n messages from the endpoint, oldest first, to 'msgs',
+// which must be mapped in the current address space, which must be e's.
+// If the endpoint is empty, mark e as waiting for a post instead; the
+// caller must then block e.
+// Returns the number of messages moved, or < 0 on error.  Errors are:
+//	-E_INVAL if epid is not an endpoint of e's.
+int
+ep_recv(struct Env *e, epid_t epid, struct Epmsg *msgs, uint32_t n)
+{
+	struct Endpoint *ep;
+	uint32_t i;
+
+	if ((ep = ep_lookup(epid)) == NULL || ep->ep_owner != e->env_id)
+		return -E_INVAL;
+
+	for (i = 0; i < n && ep->ep_head != ep->ep_tail; i++)
+		msgs[i] = ep->ep_ring[ep->ep_head++ % EP_RING];
+	if (i == 0)
+		e->env_ep_recving = epid;
+	return i;
+}
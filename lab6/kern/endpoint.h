@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ENDPOINT_H
+#define JOS_KERN_ENDPOINT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/endpoint.h>
+
+int ep_alloc(struct Env *owner);
+int ep_destroy(struct Env *owner, epid_t epid);
+int ep_post(struct Env *src, epid_t epid, uint32_t value,
+	    const uint32_t *words);
+int ep_recv(struct Env *e, epid_t epid, struct Epmsg *msgs, uint32_t n);
+void ep_free_env(struct Env *e);
+
+#endif	// !JOS_KERN_ENDPOINT_H
@@ -12,12 +12,18 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/endpoint.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;	        // The current env
+uint32_t nenvs;				// Entries of envs[] mapped so far
+uint32_t nenvs_live;			// Of those, entries not ENV_FREE
 static struct Env_list env_free_list;	// Free list
+static uint32_t envs_mapped;		// Bytes of envs[] mapped so far
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+#define ENVGENSHIFT	15		// >= LOG2NENV
 
 //
 // Converts an envid to an env pointer.
@@ -43,8 +49,14 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	// A dying environment is as good as gone.
+	if (ENVX(envid) >= nenvs) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -64,23 +76,78 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 }
 
 //
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Insert in reverse order, so that the first call to env_alloc()
-// returns envs[0].
+// The envs[] array lives at KENVS, and starts out empty: env_alloc
+// grows it when every environment in it is in use.
 //
 void
 env_init(void)
 {
 	// LAB 3: Your code here.
-	int i;
+	static_assert(NENV * sizeof(struct Env) <= ENVSIZE - PGSIZE);
 
+	envs = (struct Env *) KENVS;
+	nenvs = 0;
+	envs_mapped = 0;
 	LIST_INIT(&env_free_list);
-	for (i = NENV-1; i >= 0; i--) {
+}
+
+//
+// Map one more page of envs[], at KENVS for the kernel and at UENVS for
+// users, and mark the environments that now fit in it as free.
+// Insert them in reverse order, so that env_alloc() hands out the
+// lowest index first, and the first call returns envs[0].
+//
+// i386_vm_init allocated the page tables for both regions, and every
+// env_pgdir shares them, so the new page shows up in every address
+// space at once.  It was not mapped before, so no TLB holds it.
+//
+// Returns 0 on success, -E_NO_FREE_ENV if envs[] is as large as it
+// gets, or -E_NO_MEM if there is no page to grow it with.
+//
+static int
+env_grow(void)
+{
+	struct Page *pp;
+	uint32_t n, i;
+
+	if (nenvs == NENV)
+		return -E_NO_FREE_ENV;
+	if (page_alloc_zeroed(&pp) < 0)
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	*pgdir_walk(boot_pgdir, (void *) (KENVS + envs_mapped), 0) =
+		page2pa(pp) | PTE_W | PTE_P | PTE_G;
+	*pgdir_walk(boot_pgdir, (void *) (UENVS + envs_mapped), 0) =
+		page2pa(pp) | PTE_U | PTE_P | PTE_G;
+	envs_mapped += PGSIZE;
+
+	n = MIN(envs_mapped / sizeof(struct Env), NENV);
+	for (i = n; i-- > nenvs; ) {
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_id = 0;
 		LIST_INSERT_HEAD(&env_free_list, &envs[i], env_link);
 	}
+	nenvs = n;
+	return 0;
+}
+
+//
+// Set e's env_status, keeping the scheduler's run queues in sync.
+// Every change to env_status after env_alloc should go through here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	// Running again for any reason ends a wait on another env.
+	if (status != ENV_NOT_RUNNABLE && e->env_wait_link.le_prev) {
+		LIST_REMOVE(e, env_wait_link);
+		e->env_wait_link.le_prev = NULL;
+	}
+	e->env_status = status;
+	if (status == ENV_RUNNABLE && e->env_cpunum < 0)
+		sched_enqueue(e);
+	else if (status != ENV_RUNNABLE)
+		sched_dequeue(e);
 }
 
 //
@@ -100,7 +167,7 @@ env_setup_vm(struct Env *e)
 	struct Page *p = NULL;
 
 	// Allocate a page for the page directory
-	if ((r = page_alloc(&p)) < 0)
+	if ((r = page_alloc_zeroed(&p)) < 0)
 		return r;
 
 	// Now, set e->env_pgdir and e->env_cr3,
@@ -121,7 +188,6 @@ env_setup_vm(struct Env *e)
 	// LAB 3: Your code here.
 	e->env_pgdir = page2kva(p);
 	e->env_cr3 = PADDR(e->env_pgdir);
-	memset(e->env_pgdir, 0x0, PGSIZE);
 	p->pp_ref++;
 
 	// Initialize the pgdir element, using boot_pgdir as a template
@@ -142,7 +208,7 @@ env_setup_vm(struct Env *e)
 // On success, the new environment is stored in *newenv_store.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
-//	-E_NO_FREE_ENV if all NENVS environments are allocated
+//	-E_NO_FREE_ENV if all NENV environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
 int
@@ -152,8 +218,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = LIST_FIRST(&env_free_list)))
-		return -E_NO_FREE_ENV;
+	while (!(e = LIST_FIRST(&env_free_list)))
+		if ((r = env_grow()) < 0)
+			return r;
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0)
@@ -167,8 +234,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_prio = ENV_PRIO_NORMAL;
+	e->env_shares = ENV_SHARES_MAX;
+	e->env_pass = 0;
+	e->env_cpunum = -1;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -195,16 +265,28 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag, and the queue of senders.
 	e->env_ipc_recving = 0;
-
-	// If this is the file server (e == &envs[1]) give it I/O privileges.
+	e->env_ipc_recvfrom = 0;
+	e->env_ipc_sendto = 0;
+	e->env_ipc_calling = 0;
+	TAILQ_INIT(&e->env_ipc_senders);
+	e->env_ep_recving = 0;
+	e->env_wait_link.le_prev = NULL;
+	LIST_INIT(&e->env_waiters);
+
+	// If this is the file server (e == &envs[ENVX_FS]) give it I/O privileges.
 	// LAB 5: Your code here.
-	if (e == &envs[1])
+	// It also runs ahead of ordinary environments.
+	if (e == &envs[ENVX_FS]) {
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
+		e->env_prio = ENV_PRIO_MAX;
+	}
 
 	// commit the allocation
 	LIST_REMOVE(e, env_link);
+	nenvs_live++;
+	env_set_status(e, ENV_RUNNABLE);
 	*newenv_store = e;
 
 	return 0;
@@ -231,8 +313,8 @@ segment_alloc(struct Env *e, void *va, size_t len)
 	int i;
 	int err_no;
 
+	len = ROUNDUP((uintptr_t) va + len, PGSIZE) - ROUNDDOWN((uintptr_t) va, PGSIZE);
 	va = ROUNDDOWN(va, PGSIZE);
-	len = ROUNDUP(len, PGSIZE);
 
 	for (i = 0;i < len; i += PGSIZE) {
 		if ((err_no=page_alloc(&ppage)) == -E_NO_MEM) {
@@ -245,6 +327,24 @@ segment_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Like segment_alloc, but map [va, va+len) to the zero page, so that
+// the memory costs nothing until the environment first writes it.
+// The kernel must not write there itself.
+//
+static void
+segment_zero(struct Env *e, void *va, size_t len)
+{
+	uintptr_t a, end;
+	int r;
+
+	end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+	for (a = ROUNDDOWN((uintptr_t) va, PGSIZE); a < end; a += PGSIZE)
+		if ((r = page_insert_zero(e->env_pgdir, (void *) a,
+					  PTE_U|PTE_W|PTE_P)) < 0)
+			panic("segment_zero: %e", r);
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -301,14 +401,21 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 
 	// LAB 3: Your code here.
 	struct Proghdr *ph, *eph;
+	uintptr_t filend, memend;
 	ph = (struct Proghdr *) (binary + ((struct Elf *)binary)->e_phoff);
 	eph = ph + ((struct Elf *)binary)->e_phnum;
 	lcr3(e->env_cr3);
 	while (ph < eph) {
 		if (ph->p_type == ELF_PROG_LOAD) {
-			segment_alloc(e, (void *)ph->p_va, ph->p_memsz);
+			// Only the pages holding file data need memory now;
+			// the rest of the bss starts out as the zero page.
+			filend = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+			memend = ph->p_va + ph->p_memsz;
+			segment_alloc(e, (void *)ph->p_va, filend - ph->p_va);
 			memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-			memset((void *)(ph->p_va + ph->p_filesz), 0x0, ph->p_memsz - ph->p_filesz);
+			memset((void *)(ph->p_va + ph->p_filesz), 0x0, MIN(memend, filend) - (ph->p_va + ph->p_filesz));
+			if (memend > filend)
+				segment_zero(e, (void *)filend, memend - filend);
 		}
 		ph++;
 		
@@ -357,38 +464,54 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct Env *w;
 	
 	// If freeing the current environment, switch to boot_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(boot_cr3);
+		thiscpu->cpu_nflush++;
+	}
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// invalidating their TLB entries all at once at the end
 	static_assert(UTOP % PTSIZE == 0);
+	tlb_batch_begin();
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a superpage has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_decref(pa2page(PDE_PS_ADDR(e->env_pgdir[pdeno])));
+			e->env_pgdir[pdeno] = 0;
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
+		// unmap all PTEs in this page table, and drop the pages
+		// swapped out of it, unless another page directory still
+		// shares it after a fork
+		if (pa2page(pa)->pp_ref == 1)
+			for (pteno = 0; pteno <= PTX(~0); pteno++) {
+				if ((pt[pteno] & PTE_P) || PTE_SWAPPED(pt[pteno]))
+					page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+			}
 
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
+	tlb_batch_end();
 
 	// free the page directory
 	pa = e->env_cr3;
@@ -396,19 +519,56 @@ env_free(struct Env *e)
 	e->env_cr3 = 0;
 	page_decref(pa2page(pa));
 
+	// Stop waiting to send, and fail the sends waiting for us.
+	if (e->env_ipc_sendto) {
+		w = &envs[ENVX(e->env_ipc_sendto)];
+		TAILQ_REMOVE(&w->env_ipc_senders, e, env_ipc_link);
+		e->env_ipc_sendto = 0;
+	}
+	while ((w = TAILQ_FIRST(&e->env_ipc_senders)) != NULL) {
+		TAILQ_REMOVE(&e->env_ipc_senders, w, env_ipc_link);
+		w->env_ipc_sendto = 0;
+		w->env_ipc_calling = 0;
+		w->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		env_set_status(w, ENV_RUNNABLE);
+	}
+	// Likewise the calls waiting for our reply, and wake those waiting
+	// for us to exit; env_set_status takes them off env_waiters.
+	while ((w = LIST_FIRST(&e->env_waiters)) != NULL) {
+		if (w->env_ipc_recving) {
+			w->env_ipc_recving = 0;
+			w->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		}
+		env_set_status(w, ENV_RUNNABLE);
+	}
+
+	ep_free_env(e);
+
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	timer_cancel(e);
+	e->env_cpunum = -1;
+	env_set_status(e, ENV_FREE);
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
+	nenvs_live--;
 }
 
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
-// to the caller).
+// to the caller).  If e is running on another CPU, it is only marked
+// ENV_DYING here and freed by that CPU.
 //
 void
 env_destroy(struct Env *e) 
 {
+	// If e is currently running on other CPUs, we change its state to
+	// ENV_DYING.  A zombie environment will be freed the next time
+	// it traps to the kernel.
+	if (e->env_cpunum >= 0 && e != curenv) {
+		env_set_status(e, ENV_DYING);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -458,9 +618,32 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 	
 	// LAB 3: Your code here.
+
+	// The running environment is never on a run queue,
+	// so put the one we're leaving back if it can still run.
+	if (curenv && curenv != e) {
+		curenv->env_cpunum = -1;
+		if (curenv->env_status == ENV_RUNNABLE)
+			sched_enqueue(curenv);
+	}
+	sched_dequeue(e);
+	sched_idle_stop();
+
 	curenv = e;
+	curenv->env_cpunum = cpunum();
 	curenv->env_runs++;
-	lcr3(curenv->env_cr3);
+	// Resuming the environment that was already loaded here, after a
+	// system call or an interrupt, keeps its TLB entries.  Any change
+	// to its mappings in between was flushed by tlb_invalidate.
+	if (rcr3() != curenv->env_cr3) {
+		lcr3(curenv->env_cr3);
+		thiscpu->cpu_nflush++;
+	} else
+		thiscpu->cpu_ncr3skip++;
+	timer_arm(1);
+
+	// Leave the kernel.
+	unlock_kernel();
 	env_pop_tf(&(e->env_tf));
 }
 
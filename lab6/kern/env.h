@@ -4,6 +4,7 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <kern/cpu.h>
 
 #ifndef JOS_MULTIENV
 // Change this value to 1 once you're allowing multiple environments
@@ -12,7 +13,9 @@
 #endif
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;	        // Current environment
+extern uint32_t nenvs;			// Entries of envs[] mapped so far
+extern uint32_t nenvs_live;		// Of those, entries not ENV_FREE
+#define curenv (thiscpu->cpu_env)		// Current environment
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
 
@@ -21,6 +24,7 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, size_t size);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
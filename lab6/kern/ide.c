@@ -0,0 +1,129 @@
+/*
+ * Minimal PIO-based (non-interrupt-driven) IDE driver for the kernel's
+ * own disk, the master drive on the secondary channel, which holds the
+ * swap area (see kern/swap.c).  The file server drives the primary
+ * channel itself (fs/ide.c), so the two never share a controller.
+ */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+
+#define IDE_IOBASE	0x170	// Secondary channel's command registers
+#define IDE_CTLBASE	0x376	// ... and its device control register
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define IDE_NIEN	0x02	// Device control: no interrupts, we poll
+
+// How many times to poll the status register before giving up on the
+// disk.  Swap runs with the big kernel lock held, so a wedged disk
+// must not keep the kernel waiting forever.
+#define IDE_TIMEOUT	1000000
+
+uint32_t ide_nsecs;
+
+static int
+ide_wait_ready(bool check_error)
+{
+	int r, x;
+
+	for (x = 0; x < IDE_TIMEOUT
+	     && ((r = inb(IDE_IOBASE+7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY; x++)
+		/* do nothing */;
+
+	if (x == IDE_TIMEOUT)
+		return -1;
+	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+// Look for a disk and learn its size from IDENTIFY DEVICE.  An empty
+// channel reads back 0 or 0xFF, and a CD-ROM (which QEMU puts here when
+// there is no disk) aborts the command.  Without a disk, ide_nsecs
+// stays 0, and ide_read and ide_write must not be called.
+void
+ide_init(void)
+{
+	uint32_t id[SECTSIZE / 4];
+	int r, x;
+
+	outb(IDE_CTLBASE, IDE_NIEN);
+	outb(IDE_IOBASE+6, 0xE0);
+	for (x = 0; x < 1000 && ((r = inb(IDE_IOBASE+7)) & IDE_BSY); x++)
+		/* do nothing */;
+	if (x == 1000 || r == 0 || r == 0xFF)
+		return;
+
+	outb(IDE_IOBASE+2, 0);
+	outb(IDE_IOBASE+3, 0);
+	outb(IDE_IOBASE+4, 0);
+	outb(IDE_IOBASE+5, 0);
+	outb(IDE_IOBASE+7, 0xEC);	// CMD 0xEC means identify device
+	for (x = 0; x < 100000 && ((r = inb(IDE_IOBASE+7)) & IDE_BSY); x++)
+		/* do nothing */;
+	if (x == 100000 || (r & (IDE_DF|IDE_ERR)) || !(r & IDE_DRQ))
+		return;
+	insl(IDE_IOBASE, id, SECTSIZE/4);
+
+	// Words 60 and 61: the number of sectors LBA28 can address.
+	ide_nsecs = id[30];
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256 && ide_nsecs > 0);
+
+	if ((r = ide_wait_ready(0)) < 0)
+		return r;
+
+	outb(IDE_IOBASE+2, nsecs);
+	outb(IDE_IOBASE+3, secno & 0xFF);
+	outb(IDE_IOBASE+4, (secno >> 8) & 0xFF);
+	outb(IDE_IOBASE+5, (secno >> 16) & 0xFF);
+	outb(IDE_IOBASE+6, 0xE0 | ((secno>>24)&0x0F));
+	outb(IDE_IOBASE+7, 0x20);	// CMD 0x20 means read sector
+
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+		if ((r = ide_wait_ready(1)) < 0)
+			return r;
+		insl(IDE_IOBASE, dst, SECTSIZE/4);
+	}
+
+	return 0;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256 && ide_nsecs > 0);
+
+	if ((r = ide_wait_ready(0)) < 0)
+		return r;
+
+	outb(IDE_IOBASE+2, nsecs);
+	outb(IDE_IOBASE+3, secno & 0xFF);
+	outb(IDE_IOBASE+4, (secno >> 8) & 0xFF);
+	outb(IDE_IOBASE+5, (secno >> 16) & 0xFF);
+	outb(IDE_IOBASE+6, 0xE0 | ((secno>>24)&0x0F));
+	outb(IDE_IOBASE+7, 0x30);	// CMD 0x30 means write sector
+
+	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+		if ((r = ide_wait_ready(1)) < 0)
+			return r;
+		outsl(IDE_IOBASE, src, SECTSIZE/4);
+	}
+
+	return 0;
+}
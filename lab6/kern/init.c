@@ -3,6 +3,7 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
@@ -12,7 +13,13 @@
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
 
+static void boot_aps(void);
 
 void
 i386_init(void)
@@ -32,26 +39,41 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
+	// Must read the MP and ACPI tables before the page allocator
+	// can hand out the memory they live in.
+	mp_init();
 	i386_vm_init();
+	kmalloc_init();
+	swap_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	idt_init();
 
+	// Lab 4 multiprocessor initialization functions
+	lapic_init();
+	ioapic_init();
+
 	// Lab 4 multitasking initialization functions
 	pic_init();
 	kclock_init();
+	timer_init();
+
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
 
-	// Should always have an idle process as first one.
-	ENV_CREATE(user_idle);
+	// Starting non-boot CPUs
+	boot_aps();
 
-	// Start fs.
+	// Start fs.  It must be the first environment (ENVX_FS).
 	ENV_CREATE(fs_fs);
 
 	// Start init
 #if defined(TEST)
 	// Don't touch -- used by grading script!
 	ENV_CREATE2(TEST, TESTSIZE);
+	sched_idle_monitor = 1;
 #else
 	// Touch all you want.
 	ENV_CREATE(user_icode);
@@ -69,6 +91,67 @@ i386_init(void)
 
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct Cpu *c;
+
+	if (ncpu <= 1)
+		return;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// mpentry.S turns on paging while running at its physical
+	// address, so map VA 0:4MB to PA 0:4MB as i386_vm_init did.
+	boot_pgdir[0] = boot_pgdir[PDX(KERNBASE)] & ~PTE_G;
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == bootcpu)  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_apicid, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+
+	boot_pgdir[0] = 0;
+	lcr3(boot_cr3);
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are running at a high address now; switch to the real GDT.
+	gdt_init_percpu();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	idt_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, call sched_yield()
+	// to start running processes on this CPU.  But make sure that
+	// only one CPU can enter the scheduler at a time!
+	lock_kernel();
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
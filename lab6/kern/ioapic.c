@@ -0,0 +1,107 @@
+// The I/O APIC manages hardware interrupts for an SMP system,
+// in place of the 8259A pair.
+// http://www.intel.com/design/chipsets/datashts/29056601.pdf
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+
+#define REG_ID     0x00  // Register index: ID
+#define REG_VER    0x01  // Register index: version
+#define REG_TABLE  0x10  // Redirection table base
+
+// The redirection table starts at REG_TABLE and uses
+// two registers to configure each interrupt.
+// The first (low) register in a pair contains configuration bits.
+// The second (high) register contains a bitmask telling which
+// CPUs can serve that interrupt.
+#define INT_DISABLED   0x00010000  // Interrupt disabled
+#define INT_LEVEL      0x00008000  // Level-triggered (vs edge-)
+#define INT_ACTIVELOW  0x00002000  // Active low (vs high)
+#define INT_LOGICAL    0x00000800  // Destination is CPU id (vs APIC ID)
+
+// IO APIC MMIO structure: write reg, then read or write data.
+struct ioapic {
+	uint32_t reg;
+	uint32_t pad[3];
+	uint32_t data;
+};
+
+static volatile struct ioapic *ioapic;
+static int maxintr;
+
+static uint32_t
+ioapic_read(int reg)
+{
+	ioapic->reg = reg;
+	return ioapic->data;
+}
+
+static void
+ioapic_write(int reg, uint32_t data)
+{
+	ioapic->reg = reg;
+	ioapic->data = data;
+}
+
+void
+ioapic_init(void)
+{
+	int i;
+
+	if (!ioapicaddr)
+		return;
+
+	ioapic = mmio_map_region(ioapicaddr, 4096);
+	maxintr = (ioapic_read(REG_VER) >> 16) & 0xFF;
+
+	// Mark all interrupts edge-triggered, active high, disabled,
+	// and not routed to any CPUs.
+	for (i = 0; i <= maxintr; i++) {
+		ioapic_write(REG_TABLE+2*i, INT_DISABLED | (IRQ_OFFSET + i));
+		ioapic_write(REG_TABLE+2*i+1, 0);
+	}
+}
+
+// The redirection entry bits for MP INTI flags.  A field of 0 means the
+// bus's default, which for ISA is edge-triggered, active high.
+#define INTI_POLARITY(f)	((f) & 3)
+#define INTI_TRIGGER(f)		(((f) >> 2) & 3)
+#define INTI_LOW		3
+#define INTI_LEVEL		3
+
+static uint32_t
+ioapic_mode(uint16_t flags)
+{
+	return (INTI_POLARITY(flags) == INTI_LOW ? INT_ACTIVELOW : 0)
+		| (INTI_TRIGGER(flags) == INTI_LEVEL ? INT_LEVEL : 0);
+}
+
+// Route the ISA interrupts whose bits are clear in 'mask' to the
+// boot CPU, and disable the rest.  ISA IRQ i arrives on input
+// irq_ioapic_pin[i], as the MP or ACPI tables say; vectors still
+// follow the ISA numbering.
+void
+ioapic_setmask(uint16_t mask)
+{
+	int i, pin;
+
+	if (!ioapic)
+		return;
+	for (i = 0; i < MAX_IRQS; i++) {
+		pin = irq_ioapic_pin[i];
+		if (pin == IRQ_NOPIN || pin > maxintr)
+			continue;
+		if (mask & (1 << i))
+			ioapic_write(REG_TABLE+2*pin, INT_DISABLED | (IRQ_OFFSET + i));
+		else {
+			ioapic_write(REG_TABLE+2*pin, ioapic_mode(irq_ioapic_flags[i])
+				     | (IRQ_OFFSET + i));
+			ioapic_write(REG_TABLE+2*pin+1, bootcpu->cpu_apicid << 24);
+		}
+	}
+}
@@ -2,7 +2,9 @@
 
 /* Support for two time-related hardware gadgets: 1) the run time
  * clock with its NVRAM access functions; 2) the 8253 timer, which
- * generates interrupts on IRQ 0.
+ * generates one-shot interrupts on IRQ 0 when there is no local APIC
+ * timer, and whose channel 2 we use as a known-rate delay for
+ * calibrating the other timers.
  */
 
 #include <inc/x86.h>
@@ -32,12 +34,64 @@ mc146818_write(unsigned reg, unsigned datum)
 void
 kclock_init(void)
 {
-	/* initialize 8253 clock to interrupt 100 times/sec */
-	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
-	outb(IO_TIMER1, TIMER_DIV(100) % 256);
-	outb(IO_TIMER1, TIMER_DIV(100) / 256);
+	/* stop the 8253 clock until kern/timer.c arms it */
+	kclock_stop();
 	cprintf("	Setup timer interrupts via 8259A\n");
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<0));
 	cprintf("	unmasked timer interrupt\n");
 }
 
+// Interrupt once, 'msec' milliseconds from now.
+// The 8253 counts only 16 bits, about 54 msec; returns the delay
+// actually set.
+uint32_t
+kclock_oneshot(uint32_t msec)
+{
+	uint32_t count;
+
+	msec = MIN(MAX(msec, 1), 0xFFFF / (TIMER_FREQ / 1000));
+	count = msec * (TIMER_FREQ / 1000);
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+	outb(IO_TIMER1, count % 256);
+	outb(IO_TIMER1, count / 256);
+	return msec;
+}
+
+// Stop the timer: in mode 0 the counter waits, without interrupting,
+// until it is given a new count.
+void
+kclock_stop(void)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+}
+
+
+// Speaker control port: bit 0 gates 8253 channel 2,
+// bit 1 connects it to the speaker, bit 5 reads its output.
+#define PIT_GATE2	0x61
+
+// Busy-wait for at least 'usec' microseconds using 8253 channel 2,
+// which nothing else uses.  Works with interrupts disabled and
+// before any other timer has been calibrated.
+void
+kclock_delay(uint32_t usec)
+{
+	uint32_t n, count;
+
+	while (usec > 0) {
+		n = MIN(usec, 10000);
+		usec -= n;
+		count = n * (TIMER_FREQ / 1000) / 1000;
+		if (count == 0)
+			count = 1;
+
+		// Gate channel 2 on with the speaker off, and count down
+		// once in mode 0; OUT2 goes high at terminal count.
+		outb(PIT_GATE2, (inb(PIT_GATE2) & ~0x02) | 0x01);
+		outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+		outb(TIMER_CNTR2, count % 256);
+		outb(TIMER_CNTR2, count / 256);
+		while (!(inb(PIT_GATE2) & 0x20))
+			/* do nothing */;
+	}
+}
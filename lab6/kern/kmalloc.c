@@ -0,0 +1,306 @@
+// The kernel heap: slab caches of small objects, and kmalloc/kfree.
+//
+// Each cache hands out objects of one size from slabs, single pages
+// from page_alloc.  A slab starts with a struct Slab, which keeps the
+// slab's free objects on a list of indices, so that a free object's
+// contents are left alone: an object that the cache's constructor set
+// up stays set up when it is freed and allocated again.  Allocating
+// and freeing take the first slab off a list and an index off its free
+// list, so both are O(1).
+//
+// kmalloc serves small requests from caches of powers of two from 16 to
+// KMALLOC_MAX bytes, and bigger ones with whole blocks of pages.  Slab
+// objects never start on a page boundary (the struct Slab is there),
+// and page blocks always do, which is how kfree tells them apart.
+//
+// Like the rest of the kernel's state, the heap is protected by the big
+// kernel lock.
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+// Objects are aligned to, and their sizes rounded up to, KMEM_ALIGN.
+#define KMEM_ALIGN	8
+
+// The end of a slab's free list.
+#define SLAB_END	0xFFFF
+
+struct Slab {
+	LIST_ENTRY(Slab) s_link;	// On its cache's partial or full list
+	struct Kmem_cache *s_cache;
+	uint16_t s_inuse;		// Objects allocated
+	uint16_t s_free;		// First free object, or SLAB_END
+	uint16_t s_next[];		// The free object after each free one
+};
+
+struct Kmem_cache *kmem_caches;
+
+#define KMALLOC_NCACHE	7		// 16 << 6 == KMALLOC_MAX
+static struct Kmem_cache kmalloc_caches[KMALLOC_NCACHE];
+static const char *kmalloc_names[KMALLOC_NCACHE] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static void check_kmalloc(void);
+
+//
+// Set up 'kc' to hand out objects of 'size' bytes.  If ctor is
+// nonnull, it is run on every object when its slab is allocated, and
+// objects must be in that state whenever they are freed.
+//
+void
+kmem_cache_init(struct Kmem_cache *kc, const char *name, size_t size,
+		void (*ctor)(void *obj))
+{
+	uint32_t n;
+
+	assert(size > 0);
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+	kc->kc_ctor = ctor;
+	LIST_INIT(&kc->kc_partial);
+	LIST_INIT(&kc->kc_full);
+
+	// Fit as many objects, and their s_next entries, as we can.
+	n = (PGSIZE - sizeof(struct Slab)) / (kc->kc_size + sizeof(uint16_t));
+	while (n > 0 && ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t),
+				KMEM_ALIGN) + n * kc->kc_size > PGSIZE)
+		n--;
+	if (n == 0)
+		panic("kmem_cache_init: %s objects are too big", name);
+	kc->kc_perslab = n;
+	kc->kc_offset = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t),
+				KMEM_ALIGN);
+
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+}
+
+static void *
+slab_obj(struct Kmem_cache *kc, struct Slab *s, uint32_t i)
+{
+	return (char *) s + kc->kc_offset + i * kc->kc_size;
+}
+
+// Allocate a new slab for kc, with all of its objects free.
+static struct Slab *
+slab_alloc(struct Kmem_cache *kc)
+{
+	struct Page *pp;
+	struct Slab *s;
+	uint32_t i;
+
+	if (page_alloc(&pp) < 0)
+		return NULL;
+	s = page2kva(pp);
+	s->s_cache = kc;
+	s->s_inuse = 0;
+	s->s_free = 0;
+	for (i = 0; i < kc->kc_perslab; i++) {
+		s->s_next[i] = i + 1 < kc->kc_perslab ? i + 1 : SLAB_END;
+		if (kc->kc_ctor)
+			kc->kc_ctor(slab_obj(kc, s, i));
+	}
+	kc->kc_nslabs++;
+	return s;
+}
+
+static void
+slab_free(struct Kmem_cache *kc, struct Slab *s)
+{
+	page_free(pa2page(PADDR(s)));
+	kc->kc_nslabs--;
+}
+
+//
+// Allocate an object from kc.
+// Returns NULL if there is no memory for a new slab.
+//
+void *
+kmem_cache_alloc(struct Kmem_cache *kc)
+{
+	struct Slab *s;
+	uint32_t i;
+
+	if ((s = LIST_FIRST(&kc->kc_partial)) == NULL) {
+		if ((s = kc->kc_empty) != NULL)
+			kc->kc_empty = NULL;
+		else if ((s = slab_alloc(kc)) == NULL)
+			return NULL;
+		LIST_INSERT_HEAD(&kc->kc_partial, s, s_link);
+	}
+
+	i = s->s_free;
+	s->s_free = s->s_next[i];
+	s->s_inuse++;
+	if (s->s_free == SLAB_END) {
+		LIST_REMOVE(s, s_link);
+		LIST_INSERT_HEAD(&kc->kc_full, s, s_link);
+	}
+	kc->kc_inuse++;
+	kc->kc_nalloc++;
+	return slab_obj(kc, s, i);
+}
+
+//
+// Return obj, from kmem_cache_alloc(kc), to kc.
+// A slab left with nothing allocated is kept for the next allocation
+// if kc has no other empty slab, and given back to page_free if it has.
+//
+void
+kmem_cache_free(struct Kmem_cache *kc, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+	uint32_t off, i;
+
+	off = (char *) obj - (char *) s - kc->kc_offset;
+	i = off / kc->kc_size;
+	if (s->s_cache != kc || off % kc->kc_size || i >= kc->kc_perslab
+	    || s->s_inuse == 0)
+		panic("kmem_cache_free: %p is not a %s object", obj, kc->kc_name);
+
+	if (s->s_free == SLAB_END) {
+		LIST_REMOVE(s, s_link);
+		LIST_INSERT_HEAD(&kc->kc_partial, s, s_link);
+	}
+	s->s_next[i] = s->s_free;
+	s->s_free = i;
+	s->s_inuse--;
+	kc->kc_inuse--;
+	kc->kc_nfree++;
+
+	if (s->s_inuse == 0) {
+		LIST_REMOVE(s, s_link);
+		if (kc->kc_empty)
+			slab_free(kc, s);
+		else
+			kc->kc_empty = s;
+	}
+}
+
+void
+kmalloc_init(void)
+{
+	int i;
+
+	for (i = 0; i < KMALLOC_NCACHE; i++)
+		kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i],
+				16 << i, NULL);
+	check_kmalloc();
+}
+
+//
+// Allocate 'size' bytes of kernel memory.
+// Returns NULL if size is 0 or there is not enough memory.
+//
+void *
+kmalloc(size_t size)
+{
+	struct Page *pp;
+	int i;
+
+	if (size == 0)
+		return NULL;
+	if (size <= KMALLOC_MAX) {
+		for (i = 0; (16 << i) < size; i++)
+			;
+		return kmem_cache_alloc(&kmalloc_caches[i]);
+	}
+
+	for (i = 0; (PGSIZE << i) < size; i++)
+		if (i == PAGE_MAXORDER)
+			return NULL;
+	if (page_alloc_order(&pp, i) < 0)
+		return NULL;
+	return page2kva(pp);
+}
+
+//
+// Free memory from kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr)
+{
+	struct Slab *s;
+
+	if (ptr == NULL)
+		return;
+	if ((uintptr_t) ptr % PGSIZE == 0) {
+		page_free(pa2page(PADDR(ptr)));
+		return;
+	}
+	s = ROUNDDOWN(ptr, PGSIZE);
+	kmem_cache_free(s->s_cache, ptr);
+}
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *) obj = 0xC0FFEE;
+}
+
+static void
+check_kmalloc(void)
+{
+	static struct Kmem_cache kc;
+	static char *p[200];
+	uint32_t nfree[PAGE_MAXORDER + 1], before, after;
+	int i, order;
+
+	page_free_stats(nfree);
+	for (before = 0, order = 0; order <= PAGE_MAXORDER; order++)
+		before += nfree[order] << order;
+
+	// Every size, from every kind of slab and from pages.
+	for (i = 0; i < 200; i++) {
+		p[i] = kmalloc(1 + i * 37);
+		assert(p[i] != NULL);
+		assert((uintptr_t) p[i] % KMEM_ALIGN == 0);
+		assert(((uintptr_t) p[i] % PGSIZE == 0) == (1 + i * 37 > KMALLOC_MAX));
+		memset(p[i], i, 1 + i * 37);
+	}
+	for (i = 0; i < 200; i++)
+		assert(p[i][0] == (char) i && p[i][i * 37] == (char) i);
+	for (i = 0; i < 200; i += 2)
+		kfree(p[i]);
+	for (i = 1; i < 200; i += 2)
+		kfree(p[i]);
+	assert(kmalloc(0) == NULL);
+	kfree(NULL);
+
+	// Objects come back in their constructed state.
+	kmem_cache_init(&kc, "check", 100, check_ctor);
+	for (i = 0; i < 200; i++) {
+		p[i] = kmem_cache_alloc(&kc);
+		assert(*(uint32_t *) p[i] == 0xC0FFEE);
+	}
+	assert(kc.kc_inuse == 200);
+	assert(kc.kc_nslabs == ROUNDUP(200, kc.kc_perslab) / kc.kc_perslab);
+	for (i = 0; i < 200; i++)
+		kmem_cache_free(&kc, p[i]);
+	assert(kc.kc_inuse == 0 && kc.kc_nslabs == 1);
+	p[0] = kmem_cache_alloc(&kc);
+	assert(*(uint32_t *) p[0] == 0xC0FFEE);
+	kmem_cache_free(&kc, p[0]);
+	slab_free(&kc, kc.kc_empty);
+	kmem_caches = kc.kc_next;
+
+	// Only the caches' spare empty slabs are left.
+	page_free_stats(nfree);
+	for (after = 0, order = 0; order <= PAGE_MAXORDER; order++)
+		after += nfree[order] << order;
+	for (i = 0; i < KMALLOC_NCACHE; i++) {
+		assert(kmalloc_caches[i].kc_inuse == 0);
+		after += kmalloc_caches[i].kc_nslabs;
+		kmalloc_caches[i].kc_nalloc = kmalloc_caches[i].kc_nfree = 0;
+	}
+	assert(after == before);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,52 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+struct Slab;
+LIST_HEAD(Slab_list, Slab);
+
+// A cache of objects of one size, carved out of one-page slabs.
+// The counts are since the kernel monitor last reset them.
+struct Kmem_cache {
+	const char *kc_name;
+	uint32_t kc_size;		// Object size, rounded up
+	uint32_t kc_perslab;		// Objects in each slab
+	uint32_t kc_offset;		// Offset of the first object in a slab
+	void (*kc_ctor)(void *obj);	// Run on each object of a new slab
+
+	struct Slab_list kc_partial;	// Slabs with some objects free
+	struct Slab_list kc_full;	// Slabs with none free
+	struct Slab *kc_empty;		// One slab kept with all free, or NULL
+
+	uint32_t kc_nslabs;		// Slabs allocated
+	uint32_t kc_inuse;		// Objects allocated
+	uint32_t kc_nalloc;		// Calls to kmem_cache_alloc
+	uint32_t kc_nfree;		// Calls to kmem_cache_free
+
+	struct Kmem_cache *kc_next;	// On the list of all caches
+};
+
+// Largest size kmalloc serves from a slab cache; bigger requests get
+// whole pages.
+#define KMALLOC_MAX	1024
+
+void kmem_cache_init(struct Kmem_cache *kc, const char *name, size_t size,
+		     void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct Kmem_cache *kc);
+void kmem_cache_free(struct Kmem_cache *kc, void *obj);
+
+void kmalloc_init(void);
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+// For the kernel monitor.
+extern struct Kmem_cache *kmem_caches;
+
+#endif	// !JOS_KERN_KMALLOC_H
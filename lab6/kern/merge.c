@@ -0,0 +1,299 @@
+// Same-page merging.
+//
+// Fork-heavy workloads end up with many private copies of identical
+// pages once copy-on-write breaks.  With merging on (the kernel
+// monitor's 'merge on'), idle CPUs scan user memory, hash each page,
+// and map pages with the same contents to a single frame, copy-on-write,
+// freeing the others.  Pages of zeros go to the zero page instead.
+// sys_merge_stat turns merging on or off too, and reports on it.
+//
+// Only writable or copy-on-write pages that are mapped exactly once, in
+// a page table of their own, are merged, so the PTE being scanned is the
+// only one to change; the file server and environments that have never
+// run are left alone, as by the swap clock (see kern/swap.c).  A page
+// is write-protected before it is compared, so no CPU can change it
+// between the comparison and the merge.
+//
+// The stable table holds the shared frames, and a reference to each.
+// Thus a frame's pp_ref stays above 1 while anyone maps it, so page_cow
+// always copies it rather than making it writable again: it never
+// changes, and pages found later can merge with it too.  At the end of
+// each pass, the table lets go of the frames no one else maps, and
+// swap_reclaim makes it let go of those it would page out.
+//
+// Pages seen during a pass, which may yet change, go in the unstable
+// table by where they are mapped.  A page that matches one of them turns
+// it into a stable frame.  The unstable table starts out empty on every
+// pass.  Both tables are direct-mapped by hash: a newcomer displaces
+// the entry in its bucket, which just means a merge may be missed.
+//
+// Like the rest of the kernel's state, the tables are protected by the
+// big kernel lock.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/merge.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/timer.h>
+
+#define MERGE_NBUCKET	1024
+
+struct Mergestat mergestat;
+
+static struct {
+	uint32_t hash;
+	struct Page *pp;	// A shared frame, or NULL
+} stable[MERGE_NBUCKET];
+
+static struct {
+	uint32_t hash;
+	envid_t env;		// Where the page was seen, or 0
+	void *va;
+} unstable[MERGE_NBUCKET];
+
+// The scan's position: the page it is at, in envs[hand_envx].
+static uint32_t hand_envx;
+static uint32_t hand_vpn;
+static bool hand_done;		// The pass is over
+static uint64_t pass_start;	// When it began, from timer_msec
+
+// A page of zeros hashes to 0.
+static uint32_t
+page_hash(struct Page *pp)
+{
+	uint32_t *w = page2kva(pp), h = 0;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ w[i]) * 0x9E3779B1;
+	return h;
+}
+
+static bool
+page_is_zero(struct Page *pp)
+{
+	uint32_t *w = page2kva(pp);
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		if (w[i])
+			return 0;
+	return 1;
+}
+
+static bool
+merge_env_ok(struct Env *e)
+{
+	return (e->env_status == ENV_RUNNABLE
+		|| e->env_status == ENV_NOT_RUNNABLE)
+		&& e->env_runs > 0 && e != &envs[ENVX_FS];
+}
+
+// The PTE for 'va' in e, if it maps a page that may be merged, and that
+// page in *pp_store.  Otherwise NULL.
+static pte_t *
+merge_pte(struct Env *e, void *va, struct Page **pp_store)
+{
+	pde_t pde = e->env_pgdir[PDX(va)];
+	pte_t *pte;
+
+	if (!(pde & PTE_P) || (pde & PTE_PS)
+	    || pa2page(PTE_ADDR(pde))->pp_ref != 1)
+		return NULL;
+	pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(va);
+	if (!(*pte & PTE_P) || !(*pte & (PTE_W | PTE_COW))
+	    || (*pte & PTE_SHARE) || va == (void *) (UXSTACKTOP - PGSIZE))
+		return NULL;
+	*pp_store = pa2page(PTE_ADDR(*pte));
+	return (*pp_store)->pp_ref == 1 ? pte : NULL;
+}
+
+// Make *pte, for 'va' in pgdir, copy-on-write, and wait until no CPU
+// can still write through an old TLB entry.
+static void
+merge_protect(pde_t *pgdir, void *va, pte_t *pte)
+{
+	if (*pte & PTE_W) {
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		tlb_invalidate(pgdir, va);
+		tlb_batch_flush();
+	}
+}
+
+// Keep pp, which hashes to h, as a shared frame.
+static void
+stable_put(uint32_t h, struct Page *pp)
+{
+	int i = h % MERGE_NBUCKET;
+
+	if (stable[i].pp)
+		page_decref(stable[i].pp);
+	stable[i].hash = h;
+	stable[i].pp = pp;
+	pp->pp_ref++;
+}
+
+// Look for a page with the same contents as the one at 'va' in e, and
+// if there is one, map it there instead.
+static void
+merge_page(struct Env *e, void *va)
+{
+	struct Page *pp, *other;
+	struct Env *oe;
+	pte_t *pte, *opte;
+	uint32_t h;
+	int i;
+
+	if ((pte = merge_pte(e, va, &pp)) == NULL)
+		return;
+	h = page_hash(pp);
+	i = h % MERGE_NBUCKET;
+	mergestat.ms_nscan++;
+
+	if (h == 0) {
+		merge_protect(e->env_pgdir, va, pte);
+		if (page_is_zero(pp)) {
+			page_insert_zero(e->env_pgdir, va, *pte & PTE_USER);
+			mergestat.ms_nzero++;
+			return;
+		}
+	}
+
+	if (stable[i].pp && stable[i].hash == h) {
+		merge_protect(e->env_pgdir, va, pte);
+		if (memcmp(page2kva(pp), page2kva(stable[i].pp), PGSIZE) == 0) {
+			// The page table is there, so this cannot fail.
+			page_insert(e->env_pgdir, stable[i].pp, va, *pte & PTE_USER);
+			mergestat.ms_nmerged++;
+			return;
+		}
+	}
+
+	if (unstable[i].env && unstable[i].hash == h) {
+		oe = &envs[ENVX(unstable[i].env)];
+		if (oe->env_id == unstable[i].env && merge_env_ok(oe)
+		    && (opte = merge_pte(oe, unstable[i].va, &other)) != NULL
+		    && other != pp) {
+			merge_protect(oe->env_pgdir, unstable[i].va, opte);
+			merge_protect(e->env_pgdir, va, pte);
+			if (memcmp(page2kva(pp), page2kva(other), PGSIZE) == 0) {
+				stable_put(h, other);
+				page_insert(e->env_pgdir, other, va, *pte & PTE_USER);
+				unstable[i].env = 0;
+				mergestat.ms_nmerged++;
+				return;
+			}
+		}
+	}
+
+	unstable[i].hash = h;
+	unstable[i].env = e->env_id;
+	unstable[i].va = va;
+}
+
+// Let go of the shared frames that only the stable table still holds.
+static void
+stable_prune(void)
+{
+	int i;
+
+	for (i = 0; i < MERGE_NBUCKET; i++)
+		if (stable[i].pp && stable[i].pp->pp_ref == 1) {
+			page_decref(stable[i].pp);
+			stable[i].pp = NULL;
+		}
+}
+
+//
+// Let go of pp if the stable table holds it, so that swap_reclaim can
+// page it out.  Its mappings stay shared, but later pages no longer
+// merge with it.
+//
+void
+merge_release(struct Page *pp)
+{
+	uint32_t h = page_hash(pp);
+	int i = h % MERGE_NBUCKET;
+
+	if (stable[i].pp == pp) {
+		stable[i].pp = NULL;
+		page_decref(pp);
+	}
+}
+
+//
+// Idle-time work: take up to 'n' steps of the scan, going on from where
+// the last call left off.  A step looks at one user page, or skips a
+// page table or an environment that has nothing to merge, so a call
+// never takes long however sparse user memory is.  A new pass over all
+// of user memory starts at most every MERGE_PERIOD ms; at the end of a
+// pass, the boot CPU is asked to wake up for the next, since otherwise
+// an idle system would halt and never start it.
+// Returns the number of steps taken; 0 means there is nothing to do.
+//
+int
+merge_idle(int n)
+{
+	struct Env *e;
+	pde_t pde;
+	void *va;
+	int i;
+
+	if (!mergestat.ms_on)
+		return 0;
+	if (hand_done) {
+		if (timer_msec() - pass_start < MERGE_PERIOD)
+			return 0;
+		hand_done = 0;
+	}
+	if (hand_envx == 0 && hand_vpn == 0) {
+		memset(unstable, 0, sizeof(unstable));
+		pass_start = timer_msec();
+	}
+
+	for (i = 0; i < n; i++) {
+		e = &envs[hand_envx];
+		if (hand_vpn >= VPN(UTOP) || !merge_env_ok(e)) {
+			hand_vpn = 0;
+			if (++hand_envx < nenvs)
+				continue;
+			// That was the last environment.
+			hand_envx = 0;
+			hand_done = 1;
+			stable_prune();
+			mergestat.ms_npass++;
+			timer_wake(pass_start + MERGE_PERIOD);
+			return i + 1;
+		}
+		va = (void *) (hand_vpn << PGSHIFT);
+		pde = e->env_pgdir[PDX(va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS)
+		    || pa2page(PTE_ADDR(pde))->pp_ref != 1) {
+			// Skip to the next page table.
+			hand_vpn = ROUNDUP(hand_vpn + 1, NPTENTRIES);
+			continue;
+		}
+		merge_page(e, va);
+		hand_vpn++;
+	}
+	return i;
+}
+
+//
+// Count the shared frames, and the mappings of them, for the kernel
+// monitor.  Each mapping but one per frame is a page saved.
+//
+void
+merge_usage(uint32_t *nframes, uint32_t *nmaps)
+{
+	int i;
+
+	*nframes = *nmaps = 0;
+	for (i = 0; i < MERGE_NBUCKET; i++)
+		if (stable[i].pp && stable[i].pp->pp_ref > 1) {
+			(*nframes)++;
+			*nmaps += stable[i].pp->pp_ref - 1;
+		}
+}
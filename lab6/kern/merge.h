@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_MERGE_H
+#define JOS_KERN_MERGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+#include <inc/memlayout.h>
+
+// A pass over all user memory starts at most this often, in ms.
+#define MERGE_PERIOD	1000
+
+// Set by the kernel monitor and sys_merge_stat.
+extern struct Mergestat mergestat;
+
+int	merge_idle(int n);
+void	merge_usage(uint32_t *nframes, uint32_t *nmaps);
+void	merge_release(struct Page *pp);
+
+#endif	// !JOS_KERN_MERGE_H
@@ -11,6 +11,12 @@
 #include <kern/monitor.h>
 #include <kern/trap.h>
 #include <kern/kdebug.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/timer.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/merge.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,7 +31,14 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
-	{	"backtrace", "Display function backtrace information", mon_backtrace }
+	{	"backtrace", "Display function backtrace information", mon_backtrace },
+	{ "idle", "Display per-CPU idle time since the last report", mon_idle },
+	{ "zeropool", "Display zeroed-page pool use since the last report; 'zeropool N' caps it at N pages", mon_zeropool },
+	{ "buddy", "Display free physical memory by block size", mon_buddy },
+	{ "tlb", "Display per-CPU TLB flush rates since the last report", mon_tlb },
+	{ "slab", "Display kernel heap caches and their use since the last report", mon_slab },
+	{ "swap", "Display swap use and paging since the last report", mon_swap },
+	{ "merge", "Display same-page merging since the last report; 'merge on|off' turns it on or off", mon_merge }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -91,6 +104,160 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 }
 
 
+int
+mon_idle(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Cpu *c;
+	uint64_t now, idle, total;
+	int i;
+
+	now = read_tsc();
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		idle = c->cpu_idle_tsc;
+		if (c->cpu_idle_start)
+			idle += now - c->cpu_idle_start;
+		total = now - c->cpu_idle_marktime;
+		c->cpu_idle_marktime = now;
+		idle -= c->cpu_idle_mark;
+		c->cpu_idle_mark += idle;
+
+		// Scale down so the percentage fits 32-bit arithmetic.
+		while (total >> 24) {
+			total >>= 1;
+			idle >>= 1;
+		}
+		cprintf("CPU %d: %3u%% idle\n", i,
+			total ? (uint32_t) idle * 100 / (uint32_t) total : 0);
+	}
+	return 0;
+}
+
+int
+mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t n;
+
+	if (argc > 1)
+		zeropool.zp_target = strtol(argv[1], NULL, 0);
+
+	n = zeropool.zp_hits + zeropool.zp_misses;
+	cprintf("%u pages zeroed", zeropool.zp_npages);
+	if (zeropool.zp_target != ~0)
+		cprintf(" of %u", zeropool.zp_target);
+	cprintf("; %u of %u zeroed allocations hit (%u%%), %u pages stolen\n",
+		zeropool.zp_hits, n, n ? zeropool.zp_hits * 100 / n : 0,
+		zeropool.zp_stolen);
+	zeropool.zp_hits = zeropool.zp_misses = zeropool.zp_stolen = 0;
+	return 0;
+}
+
+int
+mon_buddy(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t nfree[PAGE_MAXORDER + 1], total, big;
+	int order;
+
+	page_free_stats(nfree);
+	total = 0;
+	for (order = 0; order <= PAGE_MAXORDER; order++) {
+		cprintf("order %2d (%4uKB): %u free\n", order,
+			(PGSIZE << order) / 1024, nfree[order]);
+		total += nfree[order] << order;
+	}
+
+	// How much of the free memory is stuck in pieces too small to
+	// back a superpage?
+	big = nfree[PAGE_MAXORDER] << PAGE_MAXORDER;
+	cprintf("%u pages free, %u in zeroed pool; %u%% fragmented\n",
+		total, zeropool.zp_npages,
+		total ? (total - big) * 100 / total : 0);
+	return 0;
+}
+
+int
+mon_tlb(int argc, char **argv, struct Trapframe *tf)
+{
+	static uint64_t marktime;
+	struct Cpu *c;
+	uint64_t now;
+	uint32_t ms;
+	int i;
+
+	now = timer_msec();
+	ms = now - marktime;
+	marktime = now;
+	if (ms == 0)
+		ms = 1;
+
+	cprintf("per second over %u.%03us:\n", ms / 1000, ms % 1000);
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		cprintf("CPU %d: %u flushes, %u invlpgs, %u shootdown IPIs, "
+			"%u %%cr3 loads skipped\n", i,
+			(uint32_t) ((uint64_t) c->cpu_nflush * 1000 / ms),
+			(uint32_t) ((uint64_t) c->cpu_ninvlpg * 1000 / ms),
+			(uint32_t) ((uint64_t) c->cpu_nshootdown * 1000 / ms),
+			(uint32_t) ((uint64_t) c->cpu_ncr3skip * 1000 / ms));
+		c->cpu_nflush = c->cpu_ninvlpg = 0;
+		c->cpu_nshootdown = c->cpu_ncr3skip = 0;
+	}
+	return 0;
+}
+
+int
+mon_slab(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Kmem_cache *kc;
+
+	cprintf("cache          size  in use/total  slabs  allocs   frees\n");
+	for (kc = kmem_caches; kc; kc = kc->kc_next) {
+		cprintf("%-13s %5u %7u/%-5u %6u %7u %7u\n", kc->kc_name,
+			kc->kc_size, kc->kc_inuse, kc->kc_nslabs * kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_nalloc, kc->kc_nfree);
+		kc->kc_nalloc = kc->kc_nfree = 0;
+	}
+	return 0;
+}
+
+int
+mon_swap(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Swapstat *sw = &swapstat;
+
+	if (sw->sw_nslots == 0) {
+		cprintf("no swap disk\n");
+		return 0;
+	}
+	cprintf("%u/%u slots in use\n", sw->sw_inuse, sw->sw_nslots);
+	cprintf("%u reclaims scanned %u PTEs; %u pages out, %u pages in\n",
+		sw->sw_nreclaim, sw->sw_nscan, sw->sw_npageout, sw->sw_npagein);
+	sw->sw_nreclaim = sw->sw_nscan = 0;
+	sw->sw_npageout = sw->sw_npagein = 0;
+	return 0;
+}
+
+int
+mon_merge(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Mergestat *ms = &mergestat;
+	uint32_t nframes, nmaps;
+
+	if (argc > 1)
+		ms->ms_on = strcmp(argv[1], "on") == 0;
+
+	merge_usage(&nframes, &nmaps);
+	cprintf("merging %s; %u passes scanned %u pages\n",
+		ms->ms_on ? "on" : "off", ms->ms_npass, ms->ms_nscan);
+	cprintf("%u pages merged, %u pages of zeros mapped to the zero page\n",
+		ms->ms_nmerged, ms->ms_nzero);
+	cprintf("%u shared frames mapped %u times: %u pages (%uKB) saved\n",
+		nframes, nmaps, nmaps - nframes,
+		(nmaps - nframes) * PGSIZE / 1024);
+	ms->ms_npass = ms->ms_nscan = 0;
+	ms->ms_nmerged = ms->ms_nzero = 0;
+	return 0;
+}
 
 /***** Kernel monitor command interpreter *****/
 
@@ -15,5 +15,12 @@ void monitor(struct Trapframe *tf);
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
+int mon_idle(int argc, char **argv, struct Trapframe *tf);
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf);
+int mon_buddy(int argc, char **argv, struct Trapframe *tf);
+int mon_tlb(int argc, char **argv, struct Trapframe *tf);
+int mon_slab(int argc, char **argv, struct Trapframe *tf);
+int mon_swap(int argc, char **argv, struct Trapframe *tf);
+int mon_merge(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
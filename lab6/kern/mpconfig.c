@@ -0,0 +1,455 @@
+// Search for and parse the multiprocessor configuration table
+// See http://developer.intel.com/design/pentium/datashts/24201606.pdf
+// If there is no MP table, fall back to the ACPI MADT.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+struct Cpu cpus[NCPU];
+struct Cpu *bootcpu;
+bool ismp;
+int ncpu;
+physaddr_t lapicaddr;
+physaddr_t ioapicaddr;
+uint8_t irq_ioapic_pin[MAX_IRQS];
+uint16_t irq_ioapic_flags[MAX_IRQS];
+
+// Per-CPU kernel stacks
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+struct mpioapic {       // I/O APIC table entry [MP 4.3.3]
+	uint8_t type;                   // entry type (2)
+	uint8_t apicno;                 // I/O APIC id
+	uint8_t version;                // I/O APIC version
+	uint8_t flags;                  // I/O APIC flags
+	physaddr_t addr;                // I/O APIC address
+} __attribute__((__packed__));
+
+struct mpbus {          // bus table entry [MP 4.3.2]
+	uint8_t type;                   // entry type (1)
+	uint8_t busid;                  // bus id
+	uint8_t bustype[6];             // bus type string, e.g. "ISA   "
+} __attribute__((__packed__));
+
+struct mpiointr {       // I/O interrupt table entry [MP 4.3.4]
+	uint8_t type;                   // entry type (3)
+	uint8_t intrtype;               // interrupt type
+	uint16_t flags;                 // INTI_* polarity and trigger mode
+	uint8_t srcbus;                 // source bus id
+	uint8_t srcirq;                 // source bus irq
+	uint8_t dstapic;                // destination I/O APIC id
+	uint8_t dstintin;               // destination I/O APIC input
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
+
+// mpiointr interrupt types
+#define MPINTR_INT 0x00                 // Vectored interrupt from the I/O APIC
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+
+// See Advanced Configuration and Power Interface Specification 1.0b
+
+struct rsdp {           // root system description pointer [ACPI 5.2.4]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdtaddr;            // phys addr of the RSDT
+} __attribute__((__packed__));
+
+struct sdthdr {         // system description table header [ACPI 5.2.5]
+	uint8_t signature[4];
+	uint32_t length;                // total table length
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct madt {           // multiple APIC description table [ACPI 5.2.8]
+	struct sdthdr hdr;              // "APIC"
+	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t flags;
+	uint8_t entries[0];
+} __attribute__((__packed__));
+
+// MADT entry types
+#define MADT_LAPIC	0x00
+#define MADT_IOAPIC	0x01
+#define MADT_OVERRIDE	0x02		// Interrupt source override
+
+#define MADT_LAPIC_ENABLED 0x01
+
+
+// mp_init runs before paging is turned on, while the boot segments
+// still map KERNBASE+x to physical x for all x below 256MB.  The
+// tables we look for may lie in memory the page allocator will later
+// hand out, so they must be read now.
+static void *
+mp_kaddr(physaddr_t pa)
+{
+	if (pa >= -KERNBASE)
+		return NULL;
+	return (void *) (pa + KERNBASE);
+}
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *) addr)[i];
+	return sum;
+}
+
+// Look for a structure with signature 'sig' whose first 'sumlen' bytes
+// add up to 0, aligned to 16 bytes, in the len bytes at physical address a.
+static void *
+sigsearch(physaddr_t a, int len, const char *sig, int sumlen)
+{
+	uint8_t *p = mp_kaddr(a), *e = mp_kaddr(a + len);
+
+	for (; p < e; p += 16)
+		if (memcmp(p, sig, strlen(sig)) == 0 && sum(p, sumlen) == 0)
+			return p;
+	return NULL;
+}
+
+// Search for a signature in the three places the BIOS may leave it:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xE0000 and 0xFFFFF.
+static void *
+biossearch(const char *sig, int sumlen)
+{
+	uint8_t *bda;
+	uint32_t p;
+	void *t;
+
+	static_assert(sizeof(*bda) == 1);
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) mp_kaddr(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((t = sigsearch(p, 1024, sig, sumlen)))
+			return t;
+	} else {
+		// The size of base memory, in KB is in the two bytes
+		// starting at 0x13 of the BDA.
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((t = sigsearch(p - 1024, 1024, sig, sumlen)))
+			return t;
+	}
+	return sigsearch(0xE0000, 0x20000, sig, sumlen);
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = biossearch("_MP_", sizeof(struct mp))) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = (struct mpconf *) mp_kaddr(mp->physaddr);
+	if (!conf || memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	if (sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	if ((sum((uint8_t *) conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+static void
+add_cpu(uint8_t apicid, bool boot)
+{
+	if (ncpu >= NCPU) {
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+		return;
+	}
+	if (boot)
+		bootcpu = &cpus[ncpu];
+	cpus[ncpu].cpu_id = ncpu;
+	cpus[ncpu].cpu_apicid = apicid;
+	ncpu++;
+}
+
+// Until a table says otherwise, ISA IRQ i arrives on I/O APIC input i,
+// edge-triggered and active high.
+static void
+irq_reset(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_IRQS; i++) {
+		irq_ioapic_pin[i] = i;
+		irq_ioapic_flags[i] = 0;
+	}
+}
+
+// Note that ISA IRQ 'irq' arrives on I/O APIC input 'pin'.  An IRQ that
+// nothing overrides then no longer owns the input: on QEMU, IRQ 0
+// arrives on input 2, and IRQ 2, the 8259A cascade, on none at all.
+static void
+irq_override(uint8_t irq, uint32_t pin, uint16_t flags)
+{
+	if (irq >= MAX_IRQS)
+		return;
+	if (pin < MAX_IRQS && pin != irq && irq_ioapic_pin[pin] == pin)
+		irq_ioapic_pin[pin] = IRQ_NOPIN;
+	irq_ioapic_pin[irq] = pin < IRQ_NOPIN ? pin : IRQ_NOPIN;
+	irq_ioapic_flags[irq] = flags;
+}
+
+static bool
+mp_table_init(void)
+{
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	struct mpbus *bus;
+	struct mpioapic *ioapic;
+	struct mpiointr *intr;
+	uint8_t *p;
+	unsigned int i;
+	int isabus, ioapicid;
+
+	if ((conf = mpconfig(&mp)) == 0)
+		return 0;
+	lapicaddr = conf->lapicaddr;
+	irq_reset();
+	isabus = ioapicid = -1;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *) p;
+			add_cpu(proc->apicid, proc->flags & MPPROC_BOOT);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+			bus = (struct mpbus *) p;
+			if (memcmp(bus->bustype, "ISA", 3) == 0)
+				isabus = bus->busid;
+			p += sizeof(struct mpbus);
+			continue;
+		case MPIOAPIC:
+			ioapic = (struct mpioapic *) p;
+			if (!ioapicaddr) {
+				ioapicaddr = ioapic->addr;
+				ioapicid = ioapic->apicno;
+			}
+			p += sizeof(struct mpioapic);
+			continue;
+		case MPIOINTR:
+			// The tables list buses and I/O APICs first.
+			intr = (struct mpiointr *) p;
+			if (intr->intrtype == MPINTR_INT && intr->srcbus == isabus
+			    && intr->dstapic == ioapicid)
+				irq_override(intr->srcirq, intr->dstintin,
+					     intr->flags);
+			p += sizeof(struct mpiointr);
+			continue;
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			return 0;
+		}
+	}
+
+	if (mp->imcrp) {
+		// [MP 3.2.6.1] If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		cprintf("SMP: Setting IMCR to switch from PIC mode to symmetric I/O mode\n");
+		outb(0x22, 0x70);   // Select IMCR
+		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
+	}
+	return 1;
+}
+
+// Find the MADT through the RSDP and RSDT.  The BSP is the CPU running
+// this code; its entry is whichever one matches our local APIC ID,
+// which lapic_init has not yet made readable, so assume the firmware
+// lists the BSP first, as the ACPI specification recommends.
+static bool
+acpi_init(void)
+{
+	struct rsdp *rsdp;
+	struct sdthdr *rsdt, *hdr;
+	struct madt *madt;
+	uint32_t *tables, gsibase;
+	uint8_t *p, *e;
+	int i, n;
+
+	if ((rsdp = biossearch("RSD PTR ", sizeof(struct rsdp))) == 0)
+		return 0;
+	rsdt = mp_kaddr(rsdp->rsdtaddr);
+	if (!rsdt || memcmp(rsdt, "RSDT", 4) != 0 || sum(rsdt, rsdt->length) != 0)
+		return 0;
+
+	madt = NULL;
+	tables = (uint32_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / 4;
+	for (i = 0; i < n; i++) {
+		hdr = mp_kaddr(tables[i]);
+		if (hdr && memcmp(hdr, "APIC", 4) == 0 && sum(hdr, hdr->length) == 0) {
+			madt = (struct madt *) hdr;
+			break;
+		}
+	}
+	if (!madt)
+		return 0;
+	lapicaddr = madt->lapicaddr;
+	irq_reset();
+
+	// Find the I/O APIC first: overrides name inputs by global
+	// system interrupt number, counted from its first input.
+	gsibase = 0;
+	p = madt->entries;
+	e = (uint8_t *) madt + madt->hdr.length;
+	for (; p + 2 <= e && p[1] >= 2; p += p[1])
+		if (p[0] == MADT_IOAPIC) {
+			// ioapic id, reserved, address, gsi base
+			ioapicaddr = *(uint32_t *) (p + 4);
+			gsibase = *(uint32_t *) (p + 8);
+			break;
+		}
+
+	p = madt->entries;
+	e = (uint8_t *) madt + madt->hdr.length;
+	while (p + 2 <= e && p[1] >= 2) {
+		switch (p[0]) {
+		case MADT_LAPIC:
+			// acpi processor id, apic id, flags
+			if (*(uint32_t *) (p + 4) & MADT_LAPIC_ENABLED)
+				add_cpu(p[3], ncpu == 0);
+			break;
+		case MADT_OVERRIDE:
+			// bus (0, ISA), source irq, gsi, flags
+			if (p[2] == 0 && *(uint32_t *) (p + 4) >= gsibase)
+				irq_override(p[3], *(uint32_t *) (p + 4) - gsibase,
+					     *(uint16_t *) (p + 8));
+			break;
+		}
+		p += p[1];
+	}
+	return ncpu > 0;
+}
+
+void
+mp_init(void)
+{
+	ismp = mp_table_init();
+	if (!ismp) {
+		ncpu = 0;
+		bootcpu = NULL;
+		ioapicaddr = 0;
+		ismp = acpi_init();
+	}
+
+	if (!ismp || !bootcpu) {
+		// Didn't like what we found; fall back to no MP.
+		ismp = 0;
+		ncpu = 1;
+		lapicaddr = 0;
+		ioapicaddr = 0;
+		irq_reset();
+		bootcpu = &cpus[0];
+		bootcpu->cpu_id = 0;
+		bootcpu->cpu_apicid = 0;
+		bootcpu->cpu_status = CPU_STARTED;
+		cprintf("SMP: configuration not found, SMP disabled\n");
+		return;
+	}
+	bootcpu->cpu_status = CPU_STARTED;
+	cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_id, ncpu);
+}
@@ -3,6 +3,7 @@
 #include <inc/assert.h>
 
 #include <kern/picirq.h>
+#include <kern/cpu.h>
 
 
 // Current IRQ mask.
@@ -10,7 +11,9 @@
 uint16_t irq_mask_8259A = 0xFFFF & ~(1<<IRQ_SLAVE);
 static bool didinit;
 
-/* Initialize the 8259A interrupt controllers. */
+/* Initialize the 8259A interrupt controllers.
+ * On machines with an I/O APIC they stay fully masked, and
+ * irq_setmask_8259A() programs the I/O APIC instead. */
 void
 pic_init(void)
 {
@@ -74,8 +77,20 @@ irq_setmask_8259A(uint16_t mask)
 	irq_mask_8259A = mask;
 	if (!didinit)
 		return;
-	outb(IO_PIC1+1, (char)mask);
-	outb(IO_PIC2+1, (char)(mask >> 8));
+
+	// Each local APIC has its own timer, which replaces IRQ 0.
+	if (lapic)
+		mask |= 1 << IRQ_TIMER;
+
+	if (ioapicaddr) {
+		// The cascade line means nothing to the I/O APIC.
+		outb(IO_PIC1+1, 0xFF);
+		outb(IO_PIC2+1, 0xFF);
+		ioapic_setmask(mask | (1 << IRQ_SLAVE));
+	} else {
+		outb(IO_PIC1+1, (char)mask);
+		outb(IO_PIC2+1, (char)(mask >> 8));
+	}
 	cprintf("enabled interrupts:");
 	for (i = 0; i < 16; i++)
 		if (~mask & (1<<i))
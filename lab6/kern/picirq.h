@@ -25,6 +25,13 @@ extern uint16_t irq_mask_8259A;
 void pic_init(void);
 void irq_setmask_8259A(uint16_t mask);
 
+// The I/O APIC input each ISA IRQ arrives on, or IRQ_NOPIN, and its
+// polarity and trigger mode as MP INTI_* flags.  mp_init fills these
+// in from the interrupt source overrides in the MP or ACPI tables.
+#define IRQ_NOPIN	0xFF
+extern uint8_t irq_ioapic_pin[MAX_IRQS];
+extern uint16_t irq_ioapic_flags[MAX_IRQS];
+
 #endif // !__ASSEMBLER__
 
 #endif // !JOS_KERN_PICIRQ_H
@@ -9,6 +9,11 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/timer.h>
+#include <kern/swap.h>
+#include <kern/kmalloc.h>
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
@@ -22,7 +27,13 @@ physaddr_t boot_cr3;		// Physical address of boot time page directory
 static char* boot_freemem;	// Pointer to next byte of free mem
 
 struct Page* pages;		// Virtual address of physical page array
-static struct Page_list page_free_list;	// Free list of physical pages
+static struct Page_list page_free_list[PAGE_MAXORDER + 1]; // Free blocks, by order
+static uint32_t page_nfree[PAGE_MAXORDER + 1];	// Length of each free list
+static struct Page_list page_zero_list;	// Free pages already zero-filled
+struct Zeropool zeropool = {		// page_zero_list's size and use
+	.zp_target = ZEROPOOL_TARGET
+};
+static struct Page *zero_page;		// Always zero; see page_insert_zero
 
 // Global descriptor table.
 //
@@ -30,7 +41,7 @@ static struct Page_list page_free_list;	// Free list of physical pages
 // To load the SS register, the CPL must equal the DPL.  Thus,
 // we must duplicate the segments for the user and the kernel.
 //
-struct Segdesc gdt[] =
+struct Segdesc gdt[(GD_TSS0 >> 3) + NCPU] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -47,8 +58,9 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in idt_init()
-	[GD_TSS >> 3] = SEG_NULL
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in idt_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -89,6 +101,8 @@ static void check_boot_pgdir(void);
 static void check_page_alloc();
 static void page_check(void);
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void boot_map_superpages(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void tlb_shootdown_now(pde_t *pgdir);
 
 //
 // A simple physical memory allocator, used only a few times
@@ -184,10 +198,21 @@ i386_vm_init(void)
 
 
 	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	// LAB 3: Your code here.
-	envs = boot_alloc(sizeof(struct Env)*NENV, PGSIZE);
-	memset(envs, 0, sizeof(struct Env)*NENV);
+	// 'envs' is not allocated here: env_init puts it at KENVS, and it
+	// grows a page at a time (see env_grow).
+
+	//////////////////////////////////////////////////////////////////////
+	// Make 'timepage' point to the page that publishes the kernel's
+	// clock to user environments.
+	timepage = boot_alloc(PGSIZE, PGSIZE);
+	memset(timepage, 0, PGSIZE);
+
+	//////////////////////////////////////////////////////////////////////
+	// Make 'zero_page' the page that lazily allocated user memory maps
+	// until it is first written.  page_init marks it in use, and that
+	// reference keeps it from ever being freed.
+	zero_page = pa2page(PADDR(boot_alloc(PGSIZE, PGSIZE)));
+	memset(page2kva(zero_page), 0, PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -210,29 +235,54 @@ i386_vm_init(void)
 	//    - pages -- kernel RW, user NONE
 	//    - the read-only version mapped at UPAGES -- kernel R, user R
 	// Your code goes here:
-	boot_map_segment(pgdir, UPAGES, sizeof(struct Page)*npage, PADDR(pages), PTE_U | PTE_P);
-	boot_map_segment(pgdir, (uintptr_t)pages, sizeof(struct Page)*npage, PADDR(pages), PTE_W | PTE_P);
+	// (The kernel's own mapping of 'pages' is part of the KERNBASE
+	// mapping below.)
+	// Every mapping above UTOP but VPT and UVPT is the same in all
+	// address spaces (env_setup_vm copies boot_pgdir's PDEs), so it is
+	// global (PTE_G): with CR4_PGE on, loading %cr3 leaves it in the TLB.
+	boot_map_segment(pgdir, UPAGES, sizeof(struct Page)*npage, PADDR(pages), PTE_U | PTE_P | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
+	// The 'envs' array is mapped a page at a time as it grows, at KENVS
+	// and read-only by the user at linear address UENVS.
 	// Permissions:
-	//    - envs itself -- kernel RW, user NONE
+	//    - envs itself, at KENVS -- kernel RW, user NONE
 	//    - the image of envs mapped at UENVS  -- kernel R, user R
-	boot_map_segment(pgdir, (uintptr_t)envs, sizeof(struct Env)*NENV, 
-			PADDR(envs), PTE_W|PTE_P);
-	boot_map_segment(pgdir, UENVS, sizeof(struct Env)*NENV, 
-			PADDR(envs), PTE_U|PTE_P);
+	// Allocate the page tables for both now, so that every env_pgdir,
+	// which copies boot_pgdir's PDEs, sees the table grow.
+	for (n = 0; n < ENVSIZE; n += PTSIZE)
+		if (!pgdir_walk(pgdir, (void *) (KENVS + n), 1)
+		    || !pgdir_walk(pgdir, (void *) (UENVS + n), 1))
+			panic("i386_vm_init: out of memory for the envs page tables");
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the kernel stack (symbol name "bootstack").  The complete VA
-	// range of the stack, [KSTACKTOP-PTSIZE, KSTACKTOP), breaks into two
-	// pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed => faults
+	// Map the time page read-only by the user at linear address UTIME.
+	// The kernel updates it through its KERNBASE mapping.
+	boot_map_segment(pgdir, UTIME, PGSIZE, PADDR(timepage), PTE_U|PTE_P|PTE_G);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack.  CPU i's kernel stack grows down from
+	// virtual address KSTACKTOP_CPU(i), and is divided into two pieces:
+	//     * [KSTACKTOP_CPU(i) - KSTKSIZE, KSTACKTOP_CPU(i))
+	//          -- backed by physical memory
+	//     * [KSTACKTOP_CPU(i) - (KSTKSIZE + KSTKGAP), KSTACKTOP_CPU(i) - KSTKSIZE)
+	//          -- not backed; so if the kernel overflows its stack,
+	//             it will fault rather than overwrite another CPU's stack.
+	//             Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
-	boot_map_segment(pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | PTE_P);
+	// The boot CPU runs on 'bootstack' until it first enters user mode.
+	for (n = 0; n < NCPU; n++)
+		boot_map_segment(pgdir, KSTACKTOP_CPU(n) - KSTKSIZE, KSTKSIZE,
+				 PADDR(percpu_kstacks[n]), PTE_W | PTE_P | PTE_G);
+
+	//////////////////////////////////////////////////////////////////////
+	// Allocate the page table for the MMIO region now, so that every
+	// env_pgdir, which copies boot_pgdir's PDEs, sees the local and
+	// I/O APIC mappings that mmio_map_region adds later.
+	if (!pgdir_walk(pgdir, (void *) MMIOBASE, 1))
+		panic("i386_vm_init: out of memory for the MMIO page table");
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -242,7 +292,8 @@ i386_vm_init(void)
 	// we just set up the amapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here: 
-	boot_map_segment(pgdir, KERNBASE, 0xFFFFFFFF - KERNBASE, (physaddr_t)0x0, PTE_W | PTE_P);
+	// Use superpages: no page tables, and one TLB entry per 4MB.
+	boot_map_superpages(pgdir, KERNBASE, 0xFFFFFFFF - KERNBASE, (physaddr_t)0x0, PTE_W | PTE_P | PTE_G);
 
 	// Check that the initial page directory has been set up correctly.
 	check_boot_pgdir();
@@ -263,12 +314,14 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	// Not globally, or the mapping would outlive pgdir[0].
+	pgdir[0] = pgdir[PDX(KERNBASE)] & ~PTE_G;
 
 	// Install page table.
 	lcr3(boot_cr3);
 
-	// Turn on paging.
+	// Turn on paging, with superpages and global pages.
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	cr0 = rcr0();
 	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_TS|CR0_EM|CR0_MP;
 	cr0 &= ~(CR0_TS|CR0_EM);
@@ -278,6 +331,22 @@ i386_vm_init(void)
 	// (x < 4MB so uses paging pgdir[0])
 
 	// Reload all segment registers.
+	gdt_init_percpu();
+
+	// Final mapping: KERNBASE+x => KERNBASE+x => x.
+
+	// This mapping was only used after paging was turned on but
+	// before the segment registers were reloaded.
+	pgdir[0] = 0;
+
+	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
+	lcr3(boot_cr3);
+}
+
+// Load the GDT and reload all segment registers on this CPU.
+void
+gdt_init_percpu(void)
+{
 	asm volatile("lgdt gdt_pd");
 	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
@@ -286,15 +355,62 @@ i386_vm_init(void)
 	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
 	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
 	asm volatile("lldt %%ax" :: "a" (0));
+}
 
-	// Final mapping: KERNBASE+x => KERNBASE+x => x.
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location.  Return the base of the reserved region.  size does *not*
+// have to be multiple of PGSIZE.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.  Because this is static, its
+	// value will be preserved between calls to mmio_map_region
+	// (just like nextfree in boot_alloc).
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va;
+	size_t off;
+
+	// Device memory must not be cached (PTE_PCD) and writes to it
+	// must go straight through (PTE_PWT).
+	off = pa % PGSIZE;
+	size = ROUNDUP(size + off, PGSIZE);
+	if (base + size > MMIOLIM || base + size < base)
+		panic("mmio_map_region: MMIO region overflow");
+	va = base;
+	boot_map_segment(boot_pgdir, va, size, pa - off, PTE_PCD | PTE_PWT | PTE_W | PTE_P | PTE_G);
+	base += size;
+	return (void *) (va + off);
+}
 
-	// This mapping was only used after paging was turned on but
-	// before the segment registers were reloaded.
-	pgdir[0] = 0;
+//
+// Take every free page into 'fl', so that the checks can see what
+// happens when memory runs out.
+//
+static void
+check_take_free(struct Page_list *fl)
+{
+	struct Page *pp;
 
-	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
-	lcr3(boot_cr3);
+	LIST_INIT(fl);
+	while (page_alloc(&pp) == 0)
+		LIST_INSERT_HEAD(fl, pp, pp_link);
+}
+
+//
+// Give the pages taken by check_take_free back.
+//
+static void
+check_give_free(struct Page_list *fl)
+{
+	struct Page *pp;
+
+	while ((pp = LIST_FIRST(fl)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free(pp);
+	}
 }
 
 //
@@ -306,12 +422,16 @@ check_page_alloc()
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl;
+	uint32_t nfree[PAGE_MAXORDER + 1], nfree1[PAGE_MAXORDER + 1];
+	int i, order;
 	
         // if there's a page that shouldn't be on
         // the free list, try to make sure it
         // eventually causes trouble.
-	LIST_FOREACH(pp0, &page_free_list, pp_link)
-		memset(page2kva(pp0), 0x97, 128);
+	for (order = 0; order <= PAGE_MAXORDER; order++)
+		LIST_FOREACH(pp0, &page_free_list[order], pp_link)
+			for (i = 0; i < (1 << order); i++)
+				memset(page2kva(pp0 + i), 0x97, 128);
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -327,8 +447,7 @@ check_page_alloc()
         assert(page2pa(pp2) < npage*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_take_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -347,13 +466,28 @@ check_page_alloc()
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
 	// give free list back
-	page_free_list = fl;
+	check_give_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// blocks come out aligned to their size, and everything merges
+	// back into the same free blocks as before
+	page_free_stats(nfree);
+	assert(page_alloc_order(&pp0, 3) == 0);
+	assert(((pp0 - pages) & 7) == 0);
+	assert(page_alloc(&pp1) == 0);
+	assert(page_alloc_order(&pp2, PAGE_MAXORDER) == 0);
+	assert(((pp2 - pages) & ((1 << PAGE_MAXORDER) - 1)) == 0);
+	assert(pp1 < pp0 || pp1 >= pp0 + 8);
+	page_free_order(pp0, 3);
+	page_free(pp1);
+	page_free_order(pp2, PAGE_MAXORDER);
+	page_free_stats(nfree1);
+	assert(memcmp(nfree, nfree1, sizeof(nfree)) == 0);
+
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
@@ -380,18 +514,30 @@ check_boot_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 	
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	// check envs array (new test for lab 3): nothing is mapped until
+	// env_alloc grows it
+	for (i = 0; i < ENVSIZE - PGSIZE; i += PGSIZE) {
+		assert(check_va2pa(pgdir, KENVS + i) == ~0);
+		assert(check_va2pa(pgdir, UENVS + i) == ~0);
+	}
+
+	// check time page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
 
 	// check phys mem
 	for (i = 0; i < npage; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// (updated in lab 4 to check per-CPU kernel stacks)
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP_CPU(n) - (KSTKSIZE + KSTKGAP);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 
 	// check for zero/non-zero in PDEs
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -399,12 +545,14 @@ check_boot_pgdir(void)
 		case PDX(VPT):
 		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
+		case PDX(MMIOBASE):
 		case PDX(UPAGES):
-		case PDX(UENVS):
 			assert(pgdir[i]);
 			break;
 		default:
-			if (i >= PDX(KERNBASE))
+			if (i >= PDX(KERNBASE)
+			    || (i >= PDX(KENVS) && i < PDX(KENVS + ENVSIZE))
+			    || (i >= PDX(UENVS) && i < PDX(UENVS + ENVSIZE)))
 				assert(pgdir[i]);
 			else
 				assert(pgdir[i] == 0);
@@ -427,6 +575,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_PS_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -475,10 +625,15 @@ page_init(void)
 
 	pages[0].pp_ref = 1;
 
+	// The page at MPENTRY_PADDR holds the AP boot code (kern/mpentry.S).
 	for (pa = PGSIZE; pa < IOPHYSMEM; pa += PGSIZE) {
 		pageptr = pa2page(pa);
+		if (pa == MPENTRY_PADDR) {
+			pageptr->pp_ref = 1;
+			continue;
+		}
 		pageptr->pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, pageptr, pp_link);
+		page_free(pageptr);
 	}
 	
 	for (pa = IOPHYSMEM; pa < EXTPHYSMEM; pa += PGSIZE) {
@@ -495,7 +650,7 @@ page_init(void)
 
 	for (i = PPN(kuplim); i < npage; i++) {
 		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
+		page_free(&pages[i]);
 	}
 }
 
@@ -510,6 +665,115 @@ page_initpp(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
+//
+// Physical pages are managed by a buddy allocator.  Free memory is
+// kept in blocks of 2^order pages, for order 0..PAGE_MAXORDER, each
+// aligned to its own size; page_free_list[order] holds the free blocks
+// of that order.  A block's buddy is the block of the same order that
+// it would merge with into a block twice the size.
+//
+
+// The buddy of the 2^order-page block starting at 'pp', or NULL if it
+// would run past the end of memory.
+static struct Page *
+page_buddy(struct Page *pp, int order)
+{
+	size_t pn = (pp - pages) ^ (1 << order);
+
+	return pn < npage ? &pages[pn] : NULL;
+}
+
+//
+// Allocates a block of 2^order physically contiguous pages, aligned
+// to its size, splitting a larger free block if need be.
+// Does NOT set the contents of the pages to zero.
+// Only the first page's Page struct is reset; the caller owns the
+// whole block and must give the same order back to page_free_order.
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- if there is no free block that large
+//
+int
+page_alloc_order(struct Page **pp_store, int order)
+{
+	struct Page *p, *buddy;
+	int k;
+
+	assert(order >= 0 && order <= PAGE_MAXORDER);
+
+	// A page freed in a TLB batch may still be mapped in some TLB.
+	tlb_batch_flush();
+
+	for (k = order; k <= PAGE_MAXORDER; k++)
+		if (!LIST_EMPTY(&page_free_list[k]))
+			break;
+	if (k > PAGE_MAXORDER) {
+		// Pages sitting zeroed in the pool may be all that
+		// keeps their buddies from merging.
+		if (zeropool.zp_npages == 0 || order == 0)
+			return -E_NO_MEM;
+		page_zero_drain();
+		return page_alloc_order(pp_store, order);
+	}
+
+	p = LIST_FIRST(&page_free_list[k]);
+	LIST_REMOVE(p, pp_link);
+	page_nfree[k]--;
+
+	// Give back the halves we don't need.
+	while (k > order) {
+		k--;
+		buddy = p + (1 << k);
+		buddy->pp_order = k;
+		buddy->pp_free = 1;
+		LIST_INSERT_HEAD(&page_free_list[k], buddy, pp_link);
+		page_nfree[k]++;
+	}
+
+	page_initpp(p);
+	p->pp_order = order;
+	*pp_store = p;
+	return 0;
+}
+
+//
+// Return a block from page_alloc_order to the free lists, merging it
+// with its buddy for as long as the buddy is free too.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	struct Page *buddy;
+
+	assert(order >= 0 && order <= PAGE_MAXORDER);
+	assert(((pp - pages) & ((1 << order) - 1)) == 0);
+	for (; order < PAGE_MAXORDER; order++) {
+		buddy = page_buddy(pp, order);
+		if (!buddy || !buddy->pp_free || buddy->pp_order != order)
+			break;
+		LIST_REMOVE(buddy, pp_link);
+		page_nfree[order]--;
+		buddy->pp_free = 0;
+		if (buddy < pp)
+			pp = buddy;
+	}
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	LIST_INSERT_HEAD(&page_free_list[order], pp, pp_link);
+	page_nfree[order]++;
+}
+
+//
+// Store the number of free blocks of each order in
+// nfree[0..PAGE_MAXORDER].
+//
+void
+page_free_stats(uint32_t *nfree)
+{
+	memmove(nfree, page_nfree, sizeof(page_nfree));
+}
+
 //
 // Allocates a physical page.
 // Does NOT set the contents of the physical page to zero -
@@ -528,26 +792,98 @@ int
 page_alloc(struct Page **pp_store)
 {
 	// Fill this function in
-	struct Page * p = LIST_FIRST(&page_free_list);
-	if(p != NULL) {
+	struct Page *p;
+
+	if (page_alloc_order(pp_store, 0) == 0)
+		return 0;
+
+	// Fall back on the pre-zeroed pages, and then on paging out user
+	// memory, before giving up.
+	if ((p = LIST_FIRST(&page_zero_list)) == NULL) {
+		if (swap_reclaim(SWAP_CLUSTER) > 0)
+			return page_alloc_order(pp_store, 0);
+		return -E_NO_MEM;
+	}
+	LIST_REMOVE(p, pp_link);
+	zeropool.zp_npages--;
+	zeropool.zp_stolen++;
+	page_initpp(p);
+	*pp_store = p;
+	return 0;
+}
+
+//
+// Like page_alloc, but the page's contents are zeroed.
+// Takes a page that the idle loop has already cleared if there is one.
+//
+int
+page_alloc_zeroed(struct Page **pp_store)
+{
+	struct Page *p = LIST_FIRST(&page_zero_list);
+
+	if (p != NULL) {
 		LIST_REMOVE(p, pp_link);
 		page_initpp(p);
+		zeropool.zp_npages--;
+		zeropool.zp_hits++;
 		*pp_store = p;
 		return 0;
-	} else {
+	}
+	if (page_alloc(&p) < 0)
 		return -E_NO_MEM;
+	zeropool.zp_misses++;
+	memset(page2kva(p), 0, PGSIZE);
+	*pp_store = p;
+	return 0;
+}
+
+//
+// Idle-time work: zero up to 'n' free pages, moving them to the
+// list page_alloc_zeroed draws from, until that list holds
+// zeropool.zp_target pages.
+// Returns the number of pages zeroed; 0 means there is nothing to do.
+//
+int
+page_zero_idle(int n)
+{
+	struct Page *p;
+	int i;
+
+	for (i = 0; i < n && zeropool.zp_npages < zeropool.zp_target
+		     && page_alloc_order(&p, 0) == 0; i++) {
+		memset(page2kva(p), 0, PGSIZE);
+		LIST_INSERT_HEAD(&page_zero_list, p, pp_link);
+		zeropool.zp_npages++;
+	}
+	return i;
+}
+
+//
+// Give every page in the zeroed pool back to the buddy allocator,
+// so that they can merge into larger blocks again.
+//
+void
+page_zero_drain(void)
+{
+	struct Page *p;
+
+	while ((p = LIST_FIRST(&page_zero_list)) != NULL) {
+		LIST_REMOVE(p, pp_link);
+		page_free_order(p, 0);
 	}
+	zeropool.zp_npages = 0;
 }
 
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
+// A block from page_alloc_order is freed whole.
 //
 void
 page_free(struct Page *pp)
 {
 	// Fill this function in
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	page_free_order(pp, pp->pp_order);
 }
 
 //
@@ -557,10 +893,212 @@ page_free(struct Page *pp)
 void
 page_decref(struct Page* pp)
 {
-	if (--pp->pp_ref == 0)
+	// The zero page is never freed, whatever its count says.
+	if (--pp->pp_ref == 0 && pp != zero_page)
 		page_free(pp);
 }
 
+// The reverse map: for each page of RAM, and each swap slot, the list of
+// user PTEs that refer to it, so that swap_out and swap_in can rewrite
+// every mapping of a page however it came to be shared (by fork, IPC or
+// same-page merging).  A PTE gets an entry when it is set to map a page
+// or hold a swapped-out one, and loses it when cleared.  The zero page,
+// which is never paged out, has no list.
+//
+// Without a swap disk there is nothing to keep the lists for, so the map
+// stays off and costs nothing: every call below does nothing.
+static struct Rmap **page_rmaps;	// Each page's list, by page number
+static struct Rmap **slot_rmaps;	// Each swap slot's list
+static uint32_t rmap_nslots;
+static struct Kmem_cache rmap_cache;
+
+//
+// Turn the reverse map on, for every page of RAM and nslots swap slots.
+// Called by swap_init, before there are any user mappings to find.
+//
+void
+rmap_init(uint32_t nslots)
+{
+	page_rmaps = kmalloc(npage * sizeof(page_rmaps[0]));
+	slot_rmaps = kmalloc(nslots * sizeof(slot_rmaps[0]));
+	if (page_rmaps == NULL || slot_rmaps == NULL)
+		panic("rmap_init: no memory for the reverse map");
+	memset(page_rmaps, 0, npage * sizeof(page_rmaps[0]));
+	memset(slot_rmaps, 0, nslots * sizeof(slot_rmaps[0]));
+	rmap_nslots = nslots;
+	kmem_cache_init(&rmap_cache, "rmap", sizeof(struct Rmap), NULL);
+}
+
+//
+// Return the list of PTEs that refer to the same page or swap slot as
+// 'pte', or NULL if there is none to keep: pte maps nothing, or the zero
+// page, or memory that is not RAM, or the reverse map is off.
+//
+struct Rmap **
+rmap_list(pte_t pte)
+{
+	if (page_rmaps == NULL)
+		return NULL;
+	if (pte & PTE_P) {
+		if (PPN(pte) >= npage || PTE_ADDR(pte) == page2pa(zero_page))
+			return NULL;
+		return &page_rmaps[PPN(pte)];
+	}
+	if (PTE_SWAPPED(pte) && PTE_SWAPSLOT(pte) < rmap_nslots)
+		return &slot_rmaps[PTE_SWAPSLOT(pte)];
+	return NULL;
+}
+
+//
+// Allocate a reverse map entry for a PTE about to be set to 'pte', and
+// store it in *rm_store, or NULL if pte needs none.  This may page out
+// user memory, so the caller must read any PTE it copies afterwards.
+// An entry that goes unused is given back with rmap_free.
+// Returns 0 on success, or -E_NO_MEM.
+//
+int
+rmap_alloc(pte_t pte, struct Rmap **rm_store)
+{
+	*rm_store = NULL;
+	if (rmap_list(pte) == NULL)
+		return 0;
+	if ((*rm_store = kmem_cache_alloc(&rmap_cache)) == NULL)
+		return -E_NO_MEM;
+	return 0;
+}
+
+void
+rmap_free(struct Rmap *rm)
+{
+	if (rm)
+		kmem_cache_free(&rmap_cache, rm);
+}
+
+//
+// Enter *pte, which has just been set, on its page's or slot's list,
+// using rm from rmap_alloc.  rm is freed if *pte turns out to need no
+// entry after all.
+//
+void
+rmap_add(pte_t *pte, struct Rmap *rm)
+{
+	struct Rmap **head = rmap_list(*pte);
+
+	if (head == NULL) {
+		rmap_free(rm);
+		return;
+	}
+	assert(rm != NULL);
+	rm->rm_pte = pte;
+	rm->rm_next = *head;
+	*head = rm;
+}
+
+//
+// Take *pte, which is about to be cleared or changed to refer to
+// something else, off its list.
+//
+void
+rmap_remove(pte_t *pte)
+{
+	struct Rmap **head = rmap_list(*pte), **p, *rm;
+
+	if (head == NULL)
+		return;
+	for (p = head; (rm = *p) != NULL; p = &rm->rm_next)
+		if (rm->rm_pte == pte) {
+			*p = rm->rm_next;
+			kmem_cache_free(&rmap_cache, rm);
+			return;
+		}
+	panic("rmap_remove: PTE %08x at %08x is not on its list", *pte, pte);
+}
+
+//
+// Copy the user PTE *src to *dst, taking another reference to the page
+// or swap slot it refers to.  Returns 0 on success, or -E_NO_MEM if
+// there is no memory for the reverse map entry, in which case *dst is
+// left alone.
+//
+int
+pte_dup(pte_t *dst, pte_t *src)
+{
+	struct Rmap *rm;
+
+	if (rmap_alloc(*src, &rm) < 0)
+		return -E_NO_MEM;
+	*dst = *src;
+	if (*dst & PTE_P)
+		pa2page(PTE_ADDR(*dst))->pp_ref++;
+	rmap_add(dst, rm);
+	return 0;
+}
+
+//
+// Clear the user PTE *pte, dropping its reference to the page or swap
+// slot it refers to.  Flushing the TLB is left to the caller.
+//
+static void
+pte_drop(pte_t *pte)
+{
+	if (*pte & PTE_P) {
+		rmap_remove(pte);
+		page_decref(pa2page(PTE_ADDR(*pte)));
+	} else if (PTE_SWAPPED(*pte))
+		swap_free(pte);
+	*pte = 0;
+}
+
+// Page tables below UTOP may be shared between page directories after
+// fork (see sys_fork).  A page table's pp_ref counts the page directories
+// that map it, and a shared page table is mapped without PTE_W in each
+// of them, so no user write gets through it.  None of its entries are
+// writable either: writable pages were made copy-on-write when it was
+// first shared.  Before a page directory changes an entry, it takes a
+// page table of its own with pgdir_unshare.
+//
+// Returns 0 on success, or -E_NO_MEM if there's no memory for the copy.
+//
+static int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	struct Page *old, *pt;
+	pte_t *src, *dst;
+	pde_t *pde = &pgdir[PDX(va)];
+	int i;
+
+	if ((uintptr_t) va >= UTOP || (*pde & (PTE_P | PTE_W | PTE_PS)) != PTE_P)
+		return 0;
+
+	old = pa2page(PTE_ADDR(*pde));
+	if (old->pp_ref == 1) {
+		// The other page directories have let go of it.
+		*pde |= PTE_W;
+		return 0;
+	}
+
+	if (page_alloc_zeroed(&pt) < 0)
+		return -E_NO_MEM;
+	src = page2kva(old);
+	dst = page2kva(pt);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (src[i] && pte_dup(&dst[i], &src[i]) < 0) {
+			while (--i >= 0)
+				pte_drop(&dst[i]);
+			page_free(pt);
+			return -E_NO_MEM;
+		}
+	pt->pp_ref = 1;
+	old->pp_ref--;
+	*pde = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+
+	// The page table moved under every page in the region.
+	if (!curenv || curenv->env_pgdir == pgdir)
+		tlb_flush_local();
+	tlb_shootdown(pgdir);
+	return 0;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -572,6 +1110,14 @@ page_decref(struct Page* pp)
 //    - pgdir_walk sets pp_ref to 1 for the new page table.
 //    - Finally, pgdir_walk returns a pointer into the new page table.
 //
+// A caller that passes create != 0 is about to change the PTE, so if
+// the page table is shared, pgdir_walk first gives pgdir its own copy,
+// and returns NULL if it can't.
+//
+// If 'va' is in a superpage (PTE_PS), there is no PTE: pgdir_walk
+// returns a pointer to the PDE, whose flags mean the same, or NULL if
+// create != 0.
+//
 // Hint: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 pte_t *
@@ -588,10 +1134,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		if (create == 0) {
 			return NULL;
 		} else {
-			if (page_alloc(&pt) == -E_NO_MEM) {	//alloc fail
+			if (page_alloc_zeroed(&pt) == -E_NO_MEM) {	//alloc fail
 				return NULL;
 			} else {		//alloc success
-				memset(page2kva(pt), 0, PGSIZE);
 				pt->pp_ref = 1;
 				pa = PTE_ADDR(page2pa(pt));
 				if ((uintptr_t)va > ULIM) {
@@ -606,8 +1151,12 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 				return &pteptr[PTX(va)];
 			}
 		}
+	} else if (pa & PTE_PS) {
+		return create ? NULL : &pgdir[PDX(va)];
 	} else {
-		pteptr = KADDR(PTE_ADDR(pa));
+		if (create && pgdir_unshare(pgdir, va) < 0)
+			return NULL;
+		pteptr = KADDR(PTE_ADDR(pgdir[PDX(va)]));
 		return &pteptr[PTX(va)];
 	}
 }
@@ -619,14 +1168,21 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //
 // Details
 //   - If there is already a page mapped at 'va', it is page_remove()d.
+//     A page swapped out from 'va' is dropped.
 //   - If necessary, on demand, allocates a page table and inserts it into
 //     'pgdir'.
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
+// If perm includes PTE_PS, pp must start a block of 2^PAGE_MAXORDER
+// pages, and is mapped as a superpage at 'va', which must be aligned to
+// PTSIZE.  Whatever was mapped in that PTSIZE region is unmapped.
+//
 // RETURNS: 
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is not aligned for a superpage, or a 4KB page
+//	is to go inside one
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -636,28 +1192,68 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 {
 	// Fill this function in
 	pte_t * pteptr;
+	pde_t *pde = &pgdir[PDX(va)];
+	struct Rmap *rm;
+
+	if (perm & PTE_PS) {
+		if ((uintptr_t) va % PTSIZE)
+			return -E_INVAL;
+		if (!((*pde & PTE_PS) && PDE_PS_ADDR(*pde) == page2pa(pp))) {
+			pp->pp_ref++;
+			pgdir_clear(pgdir, va);
+		}
+		*pde = page2pa(pp) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (*pde & PTE_PS)
+		return -E_INVAL;
 
+	// Take the reference first: allocating a page table or a reverse
+	// map entry may page out user memory, and pp must not go while it
+	// is mapped nowhere else.
+	pp->pp_ref++;
 	pteptr = pgdir_walk(pgdir, va, 1);
 
-	if (pteptr == NULL)
+	if (pteptr == NULL || rmap_alloc(page2pa(pp) | PTE_P, &rm) < 0) {
+		pp->pp_ref--;
 		return -E_NO_MEM;
+	}
 
 	if (*pteptr & PTE_P) {
 		if (PTE_ADDR(*pteptr) != page2pa(pp)) {
 			page_remove(pgdir, va);
 			*pteptr = page2pa(pp) | perm | PTE_P;
-			pp->pp_ref++;
+			rmap_add(pteptr, rm);
 			tlb_invalidate(pgdir, va);
 		} else {
+			pp->pp_ref--;
+			rmap_free(rm);
 			*pteptr = (*pteptr & ~0xfff) | perm |PTE_P;
 		}
 	} else {
+		if (PTE_SWAPPED(*pteptr))
+			swap_free(pteptr);
 		*pteptr = page2pa(pp) | perm | PTE_P;
-		pp->pp_ref++;
+		rmap_add(pteptr, rm);
 	}
 	return 0;
 }
 
+//
+// Map the shared zero page at 'va', copy-on-write, so that 'va' reads as
+// zeros but costs no memory until the first write.  page_cow then gives
+// pgdir a zeroed page of its own.  'perm' is as for page_insert; PTE_W
+// is dropped in favor of PTE_COW.
+//
+// RETURNS: as page_insert.
+//
+int
+page_insert_zero(pde_t *pgdir, void *va, int perm)
+{
+	return page_insert(pgdir, zero_page, va, (perm & ~PTE_W) | PTE_COW);
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -681,6 +1277,22 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
 	}
 }
 
+//
+// Like boot_map_segment, but map [la, la+size) with PTSIZE superpages.
+// la and pa must be multiples of PTSIZE; size is rounded up to one.
+//
+static void
+boot_map_superpages(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm)
+{
+	size_t i;
+
+	assert(la % PTSIZE == 0 && pa % PTSIZE == 0);
+	for (i = 0; i < size; i += PTSIZE) {
+		assert(!(pgdir[PDX(la+i)] & PTE_P));
+		pgdir[PDX(la+i)] = (pa+i) | perm | PTE_PS | PTE_P;
+	}
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -688,6 +1300,8 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
 // but should not be used by other callers.
 //
 // Return 0 if there is no page mapped at va.
+// If va is in a superpage, return the superpage's first page, and store
+// the address of its PDE.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -696,9 +1310,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
 	*pte_store = pgdir_walk(pgdir, va, 0);
-	if (PPN(**pte_store) >= npage) {
+	if (*pte_store == NULL || PPN(**pte_store) >= npage) {
 		return NULL;
-	} else if (**pte_store == 0) {
+	} else if (!(**pte_store & PTE_P)) {
 		return NULL;
 	} else {
 		return pa2page(PTE_ADDR(**pte_store));
@@ -720,19 +1334,72 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+// If va is in a superpage, the whole superpage is unmapped.
+// If the page at va is swapped out, it is dropped.
+//
+// Returns 0 on success, or -E_NO_MEM if the page table is shared and
+// there's no memory to give pgdir its own (see pgdir_unshare).
+//
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
 	pte_t * pte_store = NULL;
 	struct Page * pt = NULL;
 
+	if (page_lookup(pgdir, va, &pte_store) == NULL
+	    && (pte_store == NULL || !PTE_SWAPPED(*pte_store)))
+		return 0;
+	if (pgdir_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+
+	pte_store = pgdir_walk(pgdir, va, 0);
+	if (PTE_SWAPPED(*pte_store)) {
+		pte_drop(pte_store);
+		return 0;
+	}
 	pt = page_lookup(pgdir, va, &pte_store);
-	if (pt != NULL) {
-		page_decref(pt);
-		*pte_store = 0;
+	rmap_remove(pte_store);
+	page_decref(pt);
+	*pte_store = 0;
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+//
+// Unmap the whole PTSIZE region of user memory at 'va': its superpage,
+// or every page in its page table (dropping those swapped out) and then
+// the page table itself.
+// A page table that other page directories still share is just let go.
+//
+void
+pgdir_clear(pde_t *pgdir, void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct Page *pt;
+	pte_t *ptes;
+	int i;
+
+	if (!(pde & PTE_P))
+		return;
+	pgdir[PDX(va)] = 0;
+	if (pde & PTE_PS) {
+		page_decref(pa2page(PDE_PS_ADDR(pde)));
 		tlb_invalidate(pgdir, va);
+		return;
 	}
+
+	pt = pa2page(PTE_ADDR(pde));
+	if (pt->pp_ref == 1) {
+		ptes = page2kva(pt);
+		for (i = 0; i < NPTENTRIES; i++)
+			pte_drop(&ptes[i]);
+	}
+	page_decref(pt);
+
+	if (!curenv || curenv->env_pgdir == pgdir)
+		tlb_flush_local();
+	tlb_shootdown(pgdir);
 }
 
 //
@@ -742,9 +1409,192 @@ page_remove(pde_t *pgdir, void *va)
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct Cpu *c = thiscpu;
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (!curenv || curenv->env_pgdir == pgdir) {
 		invlpg(va);
+		c->cpu_ninvlpg++;
+	}
+	tlb_shootdown(pgdir);
+}
+
+//
+// Flush this CPU's whole TLB, but for global (kernel) mappings.
+//
+void
+tlb_flush_local(void)
+{
+	tlbflush();
+	thiscpu->cpu_nflush++;
+}
+
+//
+// Defer tlb_invalidate's shootdowns until tlb_batch_end, so that a run
+// of page table changes costs other CPUs one IPI and one flush of their
+// TLBs, rather than one per page.  This CPU's own TLB is kept up to
+// date as usual, so the kernel can go on using user addresses.
+//
+// A page that was unmapped may still be in other CPUs' TLBs until then,
+// so page_alloc carries out the deferred shootdown before handing out a
+// page: no page can be reused while a stale mapping of it is left.
+// Batches do not nest.
+//
+void
+tlb_batch_begin(void)
+{
+	assert(!thiscpu->cpu_tlbbatch);
+	thiscpu->cpu_tlbbatch = 1;
+}
+
+void
+tlb_batch_end(void)
+{
+	tlb_batch_flush();
+	thiscpu->cpu_tlbbatch = 0;
+}
+
+//
+// Carry out the shootdown deferred since tlb_batch_begin, if any.
+//
+void
+tlb_batch_flush(void)
+{
+	struct Cpu *c = thiscpu;
+	pde_t *pgdir = c->cpu_tlbpgdir;
+
+	if (pgdir) {
+		c->cpu_tlbpgdir = NULL;
+		tlb_shootdown_now(pgdir);
+	}
+}
+
+//
+// Make every other CPU running in address space pgdir flush its TLB,
+// and wait until they all have.  A CPU that is spinning for the kernel
+// lock answers from lock_kernel(); one in user mode gets an IPI.
+// CPUs not currently in pgdir reload %cr3 before next using it.
+// Between tlb_batch_begin and tlb_batch_end, this is only noted.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct Cpu *c = thiscpu;
+
+	if (!c->cpu_tlbbatch)
+		tlb_shootdown_now(pgdir);
+	else if (c->cpu_tlbpgdir != pgdir) {
+		tlb_batch_flush();
+		c->cpu_tlbpgdir = pgdir;
+	}
+}
+
+//
+// Flush this CPU's TLB and every other CPU's that is running an
+// environment, for a change that may touch any address space: one to a
+// page mapped in several, or through a page table they share.
+//
+void
+tlb_shootdown_all(void)
+{
+	tlb_flush_local();
+	tlb_batch_flush();
+	tlb_shootdown_now(NULL);
+}
+
+// As tlb_shootdown, but not deferred; pgdir NULL means every address
+// space.
+static void
+tlb_shootdown_now(pde_t *pgdir)
+{
+	struct Cpu *c;
+	int i, me;
+
+	if (ncpu <= 1)
+		return;
+	me = cpunum();
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		if (i == me || !c->cpu_env
+		    || (pgdir && c->cpu_env->env_pgdir != pgdir))
+			continue;
+		c->cpu_tlbflush = 1;
+		lapic_ipi(c->cpu_apicid, IRQ_OFFSET + IRQ_TLBFLUSH);
+		thiscpu->cpu_nshootdown++;
+	}
+	for (i = 0; i < ncpu; i++)
+		while (cpus[i].cpu_tlbflush)
+			pause();
+}
+
+//
+// Flush this CPU's TLB if another CPU asked us to.
+//
+void
+tlb_shootdown_ack(void)
+{
+	struct Cpu *c = thiscpu;
+
+	if (c->cpu_tlbflush) {
+		tlb_flush_local();
+		c->cpu_tlbflush = 0;
+	}
+}
+
+//
+// Resolve a write to the copy-on-write page mapped at 'va' in 'pgdir':
+// give pgdir a writable copy of its own.  If pgdir is the only one left
+// mapping the page, there is nothing to copy, so just make the page
+// writable again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if no user page is mapped copy-on-write at va.
+//	-E_NO_MEM if there is no memory for the copy.
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	struct Page *pp, *copy;
+	pte_t *pte;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((pp = page_lookup(pgdir, va, &pte)) == NULL
+	    || (*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_INVAL;
+	if (pgdir_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	pte = pgdir_walk(pgdir, va, 0);
+
+	// The zero page must stay zero, however few map it.
+	if (pp->pp_ref == 1 && pp != zero_page) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (*pte & PTE_PS) {
+		// A superpage is copied whole.
+		if (page_alloc_order(&copy, PAGE_MAXORDER) < 0)
+			return -E_NO_MEM;
+		memmove(page2kva(copy), page2kva(pp), PTSIZE);
+		return page_insert(pgdir, copy, ROUNDDOWN(va, PTSIZE),
+				   ((*pte & (PTE_USER | PTE_PS)) & ~PTE_COW) | PTE_W);
+	}
+
+	// Hold pp while allocating the copy, so that it is not paged out
+	// from under *pte before it is copied.
+	pp->pp_ref++;
+	if (pp == zero_page)
+		r = page_alloc_zeroed(&copy);
+	else if ((r = page_alloc(&copy)) == 0)
+		memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	if (r == 0
+	    && (r = page_insert(pgdir, copy, va,
+				((*pte & PTE_USER) & ~PTE_COW) | PTE_W)) < 0)
+		page_free(copy);
+	page_decref(pp);
+	return r;
 }
 
 static uintptr_t user_mem_check_addr;
@@ -764,6 +1614,15 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// Checking for PTE_W gives the environment its own copy of any
+// copy-on-write page in the range, as writing to it would, so that the
+// kernel can write there on the environment's behalf.  Pages in the
+// range that were swapped out are read back in, and every page checked
+// is marked accessed (PTE_A), which keeps swap_reclaim from taking it
+// again before the kernel gets to use it.  Reading one page in or
+// copying one may page out another, though, so the check is repeated
+// until a pass needs neither, and the whole range is in memory at once.
+//
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
@@ -774,24 +1633,73 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	uintptr_t va_start = (uintptr_t) va;
 	uintptr_t va_end = va_start + len;
 
-	uintptr_t vp = PPN(va_start) << PGSHIFT;
+	uintptr_t vp;
 	uintptr_t vp_end = PPN(va_end) <<PGSHIFT;
+	bool again;
 	perm |= PTE_P;
 
-	for ( ; vp <= vp_end; vp += PGSIZE) {
-		pte_t *ppte = pgdir_walk(env->env_pgdir, (void *) vp, 0);
+	do {
+		again = 0;
+		for (vp = PPN(va_start) << PGSHIFT; vp <= vp_end; vp += PGSIZE) {
+			pte_t *ppte = pgdir_walk(env->env_pgdir, (void *) vp, 0);
 
-		if ((ppte != NULL) && ((*ppte & perm) == perm))
-			continue;
-		else {
-			user_mem_check_addr = (vp < va_start) ? va_start : vp;
-			return -E_FAULT;
+			if (ppte && PTE_SWAPPED(*ppte)) {
+				swap_in(env->env_pgdir, (void *) vp);
+				again = 1;
+				ppte = pgdir_walk(env->env_pgdir, (void *) vp, 0);
+			}
+			if (ppte && (perm & PTE_W) && (*ppte & PTE_COW)) {
+				page_cow(env->env_pgdir, (void *) vp);
+				again = 1;
+				ppte = pgdir_walk(env->env_pgdir, (void *) vp, 0);
+			}
+			if ((ppte != NULL) && ((*ppte & perm) == perm)) {
+				*ppte |= PTE_A;
+				continue;
+			} else {
+				user_mem_check_addr = (vp < va_start) ? va_start : vp;
+				return -E_FAULT;
+			}
 		}
-	}
+	} while (again);
 
 	return 0;
 }
 
+//
+// Count the pages 'env' has mapped below UTOP into 'em': all of them,
+// including those swapped out, and those that are in memory and are
+// not the zero page.
+//
+void
+user_mem_stat(struct Env *env, struct Envmem *em)
+{
+	pde_t *pgdir = env->env_pgdir;
+	pte_t *pt;
+	int pdx, ptx;
+
+	em->em_committed = em->em_resident = 0;
+	for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+		if (!(pgdir[pdx] & PTE_P))
+			continue;
+		if (pgdir[pdx] & PTE_PS) {
+			em->em_committed += NPTENTRIES;
+			em->em_resident += NPTENTRIES;
+			continue;
+		}
+		pt = KADDR(PTE_ADDR(pgdir[pdx]));
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			if (PTE_SWAPPED(pt[ptx]))
+				em->em_committed++;
+			if (!(pt[ptx] & PTE_P))
+				continue;
+			em->em_committed++;
+			if (PTE_ADDR(pt[ptx]) != page2pa(zero_page))
+				em->em_resident++;
+		}
+	}
+}
+
 //
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U'.
@@ -829,8 +1737,7 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_take_free(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -954,7 +1861,7 @@ page_check(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_give_free(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -9,6 +9,7 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 struct Env;
+struct Envmem;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -45,24 +46,76 @@ extern size_t npage;
 extern physaddr_t boot_cr3;
 extern pde_t *boot_pgdir;
 
+// The buddy allocator's largest block: 2^PAGE_MAXORDER pages, one PTSIZE.
+#define PAGE_MAXORDER	10
+
+// The pool of free pages that the idle loop has already zeroed.
+// It holds at most ZEROPOOL_TARGET pages unless the kernel monitor says
+// otherwise: each of them is a page the buddy allocator can't merge.
+#define ZEROPOOL_TARGET	1024
+
+// The counts are since the kernel monitor last reset them.
+struct Zeropool {
+	uint32_t zp_npages;	// Pages in the pool
+	uint32_t zp_target;	// Stop zeroing at this many
+	uint32_t zp_hits;	// page_alloc_zeroed took a page from the pool
+	uint32_t zp_misses;	// ... found it empty and zeroed a page itself
+	uint32_t zp_stolen;	// page_alloc took a page for lack of dirty ones
+};
+
+extern struct Zeropool zeropool;
+
 extern struct Segdesc gdt[];
 extern struct Pseudodesc gdt_pd;
 
 void	i386_vm_init();
 void	i386_detect_memory();
+void	gdt_init_percpu(void);
+void	*mmio_map_region(physaddr_t pa, size_t size);
+
+// One user PTE on a page's or swap slot's reverse map (see rmap_init).
+struct Rmap {
+	pte_t *rm_pte;
+	struct Rmap *rm_next;
+};
 
 void	page_init(void);
 int	page_alloc(struct Page **pp_store);
+int	page_alloc_zeroed(struct Page **pp_store);
+int	page_alloc_order(struct Page **pp_store, int order);
+int	page_zero_idle(int n);
+void	page_zero_drain(void);
 void	page_free(struct Page *pp);
+void	page_free_order(struct Page *pp, int order);
+void	page_free_stats(uint32_t *nfree);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_insert_zero(pde_t *pgdir, void *va, int perm);
+int	page_remove(pde_t *pgdir, void *va);
+void	pgdir_clear(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
+int	page_cow(pde_t *pgdir, void *va);
+
+void	rmap_init(uint32_t nslots);
+struct Rmap **rmap_list(pte_t pte);
+int	rmap_alloc(pte_t pte, struct Rmap **rm_store);
+void	rmap_free(struct Rmap *rm);
+void	rmap_add(pte_t *pte, struct Rmap *rm);
+void	rmap_remove(pte_t *pte);
+int	pte_dup(pte_t *dst, pte_t *src);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush_local(void);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_batch_flush(void);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_shootdown_all(void);
+void	tlb_shootdown_ack(void);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void	user_mem_stat(struct Env *env, struct Envmem *em);
 
 static inline ppn_t
 page2ppn(struct Page *pp)
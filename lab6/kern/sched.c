@@ -1,46 +1,416 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/merge.h>
 
 
-// Choose a user environment to run and run it.
+// Run queues.  Each CPU has one queue per priority level.
+// An environment is on some CPU's rq_prio[e->env_prio] exactly when it
+// is ENV_RUNNABLE and is not running on any CPU; e->env_runq_cpu says
+// which CPU's.
+// Bit p of rq_bitmap is set iff rq_prio[p] is nonempty, so picking the
+// next environment never looks at more than one queue head per CPU.
+// Like the rest of the kernel's state, the run queues are protected
+// by the big kernel lock.
+TAILQ_HEAD(Env_runq, Env);
+
+// Each priority level is a calendar queue for stride scheduling: bucket
+// b holds, in FIFO order, the envs whose pass falls in the b'th
+// PASS_BUCKET-wide slice of virtual time, mod NBUCKET slices.  A queued
+// env's pass is never more than STRIDE1 past the level's virtual time,
+// pq_pass, nor before pq_pass's bucket, so the buckets cover them all
+// without wrapping, and the env to run next heads the first nonempty
+// bucket at or after pq_pass's.  Enqueueing and picking thus take
+// constant time, at the price of taking envs whose passes are within
+// PASS_BUCKET of each other in turn rather than strictly by pass.
+#define NBUCKET		128
+#define PASS_BUCKET	(2 * STRIDE1 / NBUCKET)
+#define BUCKET(pass)	((pass) / PASS_BUCKET % NBUCKET)
+
+struct Prioq {
+	struct Env_runq pq_bucket[NBUCKET];
+	uint32_t pq_bitmap[NBUCKET / 32];	// Nonempty buckets
+	uint32_t pq_len;		// Number of queued environments
+
+	// Pass of the most recently dispatched environment: this
+	// level's notion of current virtual time.
+	uint32_t pq_pass;
+};
+
+struct Runq {
+	struct Prioq rq_prio[NPRIO];
+	uint32_t rq_bitmap;
+	uint32_t rq_len;	// Number of queued environments
+};
+
+static struct Runq runqs[NCPU];
+
+// Pages an idle CPU zeroes between checks for runnable environments.
+#define IDLE_ZERO_BATCH	8
+
+// Pages an idle CPU looks at for merging between checks.
+#define IDLE_MERGE_BATCH	16
+
+// Break into the monitor whenever the whole system goes idle.
+// Set for grading runs, which expect to find the monitor once the
+// test program is done.
+bool sched_idle_monitor;
+static bool idle_monitored;
+
+// Does pass a come before pass b?  Passes wrap around, so compare
+// the difference rather than the values themselves.
+#define PASS_BEFORE(a, b)	((int32_t) ((a) - (b)) < 0)
+
 void
-sched_yield(void)
+sched_init(void)
+{
+	int i, j, b;
+
+	for (i = 0; i < NCPU; i++) {
+		for (j = 0; j < NPRIO; j++)
+			for (b = 0; b < NBUCKET; b++)
+				TAILQ_INIT(&runqs[i].rq_prio[j].pq_bucket[b]);
+		runqs[i].rq_bitmap = 0;
+		runqs[i].rq_len = 0;
+	}
+}
+
+static bool
+sched_queued(struct Env *e)
+{
+	return e->env_runq_link.tqe_prev != NULL;
+}
+
+// The highest nonempty priority level in rq.
+static int
+rq_top(struct Runq *rq)
+{
+	return 31 - __builtin_clz(rq->rq_bitmap);
+}
+
+// The env to run next from the nonempty level pq: the head of the
+// first nonempty bucket, starting from pq_pass's.
+static struct Env *
+prioq_first(struct Prioq *pq)
+{
+	uint32_t b, w, i, bits;
+
+	b = BUCKET(pq->pq_pass);
+	for (i = 0; i <= NBUCKET / 32; i++) {
+		w = (b / 32 + i) % (NBUCKET / 32);
+		bits = pq->pq_bitmap[w];
+		if (i == 0)
+			bits &= ~0U << (b % 32);
+		if (bits)
+			return TAILQ_FIRST(&pq->pq_bucket[w * 32 + __builtin_ctz(bits)]);
+	}
+	panic("prioq_first: level is empty");
+}
+
+// Halted CPUs take no timer interrupts, so send one of them an IPI
+// to come and steal new work.
+static void
+sched_wake_cpu(void)
 {
-	// Implement simple round-robin scheduling.
-	// Search through 'envs' for a runnable environment,
-	// in circular fashion starting after the previously running env,
-	// and switch to the first such environment found.
-	// It's OK to choose the previously running env if no other env
-	// is runnable.
-	// But never choose envs[0], the idle environment,
-	// unless NOTHING else is runnable.
-
-	// LAB 4: Your code here.
-	static int pre_envid = 0;
 	int i;
-	int id_temp;
-	/*if (curenv)*/
-		/*i = (curenv-envs)/sizeof(struct Env) + 1;*/
-	/*else*/
-		/*i = 1;*/
-	for (i = 1 ; i <= NENV; ++i) {
-		id_temp = (i+pre_envid) % NENV;
-		if (id_temp && envs[id_temp].env_status == ENV_RUNNABLE) {
-			pre_envid = id_temp;
-			env_run(&envs[id_temp]);
+
+	if (!lapic)
+		return;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_status == CPU_HALTED && &cpus[i] != thiscpu) {
+			lapic_ipi(cpus[i].cpu_apicid, IRQ_OFFSET + IRQ_WAKEUP);
 			return;
 		}
+}
+
+// Insert e into its priority's run queue on this CPU, behind every env
+// in its pass's bucket, so that envs with equal shares take turns.
+// Harmlessly does nothing if e is already queued.
+void
+sched_enqueue(struct Env *e)
+{
+	struct Runq *rq;
+	struct Prioq *pq;
+	uint32_t b;
+
+	if (sched_queued(e))
+		return;
+	assert(e->env_prio < NPRIO);
+
+	e->env_runq_cpu = cpunum();
+	rq = &runqs[e->env_runq_cpu];
+	pq = &rq->rq_prio[e->env_prio];
+
+	// An env that sat blocked must not bank the time it missed,
+	// or it would monopolize the CPU once it wakes up.  One that
+	// ran on another CPU, or at another level, may be ahead of
+	// this level's time by any amount; it waits at most a stride.
+	if (PASS_BEFORE(e->env_pass, pq->pq_pass))
+		e->env_pass = pq->pq_pass;
+	else if (PASS_BEFORE(pq->pq_pass + STRIDE1, e->env_pass))
+		e->env_pass = pq->pq_pass + STRIDE1;
+
+	b = BUCKET(e->env_pass);
+	TAILQ_INSERT_TAIL(&pq->pq_bucket[b], e, env_runq_link);
+	pq->pq_bitmap[b / 32] |= 1 << (b % 32);
+	pq->pq_len++;
+	rq->rq_bitmap |= 1 << e->env_prio;
+	rq->rq_len++;
+
+	// The environment this CPU is leaving, alone on its queue, is
+	// what this CPU runs next anyway; waking another CPU for it
+	// would only have that one find nothing and halt again.
+	if (e != curenv || rq->rq_len > 1)
+		sched_wake_cpu();
+}
+
+// Take e off its run queue.
+// Harmlessly does nothing if e is not queued.
+void
+sched_dequeue(struct Env *e)
+{
+	struct Runq *rq;
+	struct Prioq *pq;
+	uint32_t b;
+
+	if (!sched_queued(e))
+		return;
+	rq = &runqs[e->env_runq_cpu];
+	pq = &rq->rq_prio[e->env_prio];
+	b = BUCKET(e->env_pass);
+	TAILQ_REMOVE(&pq->pq_bucket[b], e, env_runq_link);
+	e->env_runq_link.tqe_prev = NULL;
+	if (TAILQ_EMPTY(&pq->pq_bucket[b]))
+		pq->pq_bitmap[b / 32] &= ~(1 << (b % 32));
+	if (--pq->pq_len == 0)
+		rq->rq_bitmap &= ~(1 << e->env_prio);
+	rq->rq_len--;
+}
+
+// Move e to priority level 'prio', requeueing it if necessary.
+void
+sched_set_prio(struct Env *e, uint32_t prio)
+{
+	bool queued = sched_queued(e);
+
+	if (queued)
+		sched_dequeue(e);
+	e->env_prio = prio;
+	if (queued)
+		sched_enqueue(e);
+}
+
+// Change e's CPU shares, requeueing it if necessary.
+void
+sched_set_shares(struct Env *e, uint32_t shares)
+{
+	bool queued = sched_queued(e);
+
+	if (queued)
+		sched_dequeue(e);
+	e->env_shares = shares;
+	if (queued)
+		sched_enqueue(e);
+}
+
+// e, just taken from rq, is about to run on this CPU.
+static void
+sched_dispatch(struct Runq *rq, struct Env *e)
+{
+	struct Prioq *pq = &rq->rq_prio[e->env_prio];
+
+	if (PASS_BEFORE(pq->pq_pass, e->env_pass))
+		pq->pq_pass = e->env_pass;
+	thiscpu->cpu_run_start = timer_usec();
+}
+
+// Charge curenv for the CPU time it has used since it was dispatched,
+// or last charged: STRIDE1 / env_shares per quantum, and at least 1,
+// so that an env that yields early pays only for what it used.  Time
+// past a quantum, spent in the kernel, goes uncharged.
+static void
+sched_charge(void)
+{
+	uint64_t now, used;
+
+	if (!curenv)
+		return;
+	now = timer_usec();
+	used = MIN(now - thiscpu->cpu_run_start, TIMER_QUANTUM * 1000);
+	thiscpu->cpu_run_start = now;
+	curenv->env_pass += MAX(used * (STRIDE1 / curenv->env_shares)
+				/ (TIMER_QUANTUM * 1000), 1);
+}
+
+// Choose the run queue to take the next environment from.
+// Stay local unless another CPU has work of strictly higher priority
+// waiting.  With nothing local, steal from the CPU with the most urgent
+// work, and among those from the one with the longest queue.
+static struct Runq *
+sched_pick(void)
+{
+	struct Runq *local, *best, *rq;
+	int i;
+
+	local = &runqs[cpunum()];
+	best = local->rq_bitmap ? local : NULL;
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqs[i];
+		if (rq == local || !rq->rq_bitmap)
+			continue;
+		if (!best || rq_top(rq) > rq_top(best)
+		    || (best != local && rq_top(rq) == rq_top(best)
+			&& rq->rq_len > best->rq_len))
+			best = rq;
 	}
+	return best;
+}
 
-	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE)
-		env_run(&envs[0]);
-	else {
-		cprintf("Destroyed all environments - nothing more to do!\n");
-		while (1)
+// Halt this CPU until an interrupt arrives.
+// The kernel lock is released; trap() takes it back on wakeup.
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+	// Wake up for the next deadline, if this CPU handles them.
+	timer_arm(0);
+
+	// Mark that this CPU is in the HALT state, so that when
+	// timer interupts come in, we know we should re-acquire the
+	// big kernel lock
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+	unlock_kernel();
+
+	// Reset stack pointer, enable interrupts and then halt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt returned");
+}
+
+// This CPU is about to run an environment: stop charging it idle time.
+void
+sched_idle_stop(void)
+{
+	struct Cpu *c = thiscpu;
+
+	if (c->cpu_idle_start) {
+		c->cpu_idle_tsc += read_tsc() - c->cpu_idle_start;
+		c->cpu_idle_start = 0;
+	}
+	if (c == bootcpu)
+		idle_monitored = 0;
+}
+
+// Is no CPU running an environment, or waiting for a timer to?
+static bool
+sched_system_idle(void)
+{
+	int i;
+
+	if (timer_pending())
+		return 0;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_env)
+			return 0;
+	return 1;
+}
+
+// There is nothing for this CPU to run.
+// Do a batch of background work and return, so the caller can look
+// for environments again; with no work left, halt.
+// Only the boot CPU enters the monitor, so that the console stays
+// on the boot CPU.
+static void
+sched_idle(void)
+{
+	// Let go of the environment we were running; another CPU may
+	// pick it up, or destroy it, while we are idle.
+	if (curenv) {
+		curenv->env_cpunum = -1;
+		curenv = NULL;
+		lcr3(boot_cr3);
+		thiscpu->cpu_nflush++;
+	}
+	if (!thiscpu->cpu_idle_start)
+		thiscpu->cpu_idle_start = read_tsc();
+
+	if (thiscpu == bootcpu && sched_system_idle()) {
+		if (nenvs_live == 0) {
+			cprintf("Destroyed all environments - nothing more to do!\n");
+			while (1)
+				monitor(NULL);
+		}
+		if (sched_idle_monitor && !idle_monitored) {
+			idle_monitored = 1;
 			monitor(NULL);
+		}
+	}
+
+	if (page_zero_idle(IDLE_ZERO_BATCH) == 0
+	    && merge_idle(IDLE_MERGE_BATCH) == 0)
+		sched_halt();
+
+	// Give other CPUs a chance at the kernel between batches.
+	unlock_kernel();
+	lock_kernel();
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Runq *rq;
+	struct Env *e;
+
+	// Run the env with the lowest pass in the highest nonempty
+	// priority level.  The current environment goes back on its
+	// own queue, so it runs again only if nothing of higher
+	// priority, or with less CPU for its shares, is waiting.
+	sched_charge();
+	if (curenv && curenv->env_status == ENV_RUNNABLE)
+		sched_enqueue(curenv);
+
+	while (1) {
+		if ((rq = sched_pick()) != NULL) {
+			e = prioq_first(&rq->rq_prio[rq_top(rq)]);
+			sched_dequeue(e);
+			sched_dispatch(rq, e);
+			env_run(e);
+		}
+		sched_idle();
+	}
+}
+
+// Give the rest of the current environment's time slice to e, if e is
+// waiting to run, so that a client and a server can hand the CPU back
+// and forth without waiting behind everything else that is runnable.
+// e does not advance its level's virtual time, since it jumps the
+// queue, but like any env it pays for the CPU time it uses.
+// Otherwise yield as usual.
+void
+sched_yield_to(struct Env *e)
+{
+	if (e != curenv && e->env_status == ENV_RUNNABLE && e->env_cpunum < 0) {
+		sched_charge();
+		thiscpu->cpu_run_start = timer_usec();
+		env_run(e);
 	}
+	sched_yield();
 }
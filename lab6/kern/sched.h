@@ -6,7 +6,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/env.h>
+
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_prio(struct Env *e, uint32_t prio);
+void sched_set_shares(struct Env *e, uint32_t shares);
+void sched_idle_stop(void);
+
+extern bool sched_idle_monitor;
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_yield_to(struct Env *e) __attribute__((noreturn));
 
 #endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,85 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+// The big kernel lock
+struct spinlock kernel_lock = {
+	.name = "kernel_lock"
+};
+
+// Check whether this CPU is holding the lock.
+static bool
+holding(struct spinlock *lock)
+{
+	return lock->locked && lock->cpu == thiscpu;
+}
+
+void
+__spin_initlock(struct spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+	lk->cpu = 0;
+}
+
+// Try to acquire the lock without spinning.
+// Returns 1 on success, 0 if the lock is held.
+bool
+spin_trylock(struct spinlock *lk)
+{
+	if (holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	if (xchg(&lk->locked, 1) != 0)
+		return 0;
+	lk->cpu = thiscpu;
+	return 1;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	while (!spin_trylock(lk))
+		pause();
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+	if (!holding(lk))
+		panic("CPU %d cannot release %s: held by CPU %d",
+		      cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+
+	lk->cpu = 0;
+
+	// The xchg serializes, so that reads before release are
+	// not reordered after it.
+	xchg(&lk->locked, 0);
+}
+
+// Acquire the big kernel lock.
+// The holder may be waiting for us to flush our TLB, which we cannot
+// learn from an interrupt while spinning here with interrupts off,
+// so answer shootdown requests between attempts.
+void
+lock_kernel(void)
+{
+	while (!spin_trylock(&kernel_lock)) {
+		tlb_shootdown_ack();
+		pause();
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Mutual exclusion lock.
+struct spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+
+	// For debugging:
+	const char *name;		// Name of lock.
+	struct Cpu *cpu;		// The CPU holding the lock.
+};
+
+void __spin_initlock(struct spinlock *lk, const char *name);
+void spin_lock(struct spinlock *lk);
+bool spin_trylock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+
+// The big kernel lock.  Every CPU holds it while running in the
+// kernel, except while halted waiting for work.
+extern struct spinlock kernel_lock;
+
+void lock_kernel(void);
+
+static inline void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+}
+
+#endif
@@ -0,0 +1,318 @@
+// Demand paging to a swap disk.
+//
+// When page_alloc runs out of memory, it calls swap_reclaim, which
+// writes user pages that have not been used lately out to the swap disk
+// (see kern/ide.c) and frees them.  A swapped-out page's PTE loses PTE_P
+// and gains PTE_SWAP, and records the page's swap slot in place of its
+// address (see inc/mmu.h).  The next touch faults, and swap_in reads the
+// page back into a fresh frame.
+//
+// Victims are chosen with a CLOCK algorithm.  The hand sweeps over every
+// environment's user page tables.  A page whose PTE_A is set has been
+// used since the hand last came by: it loses the bit and is passed over.
+// A page whose PTE_A is still clear is paged out.  The kernel sets PTE_A
+// itself on pages it has just read in or checked for a system call, and
+// one swap_reclaim never takes the hand more than once around, so those
+// pages stay put while the kernel is using them.
+//
+// A page may be mapped many times over: in a forked child and its
+// parent, through a page table sys_fork shares between them, by IPC, or
+// as one frame that same-page merging made of several.  The reverse map
+// (see rmap_init in kern/pmap.c) lists every PTE that maps it, and
+// swap_out rewrites them all to the slot, whose list they move to;
+// swap_in maps the one frame it reads back at all of them again, so the
+// sharing is as it was.  A page is passed over while any of its mappings
+// has PTE_A, and paged out only if its mappings are all that hold it.
+// PTE_SHARE pages, superpages and the UXSTACK page, which the kernel
+// writes to while delivering a fault, are left alone.  So are the file
+// server, whose block cache reads its own PTE_P and PTE_D bits, and
+// environments that have never run, whose memory the kernel may still
+// be filling in.
+//
+// A slot is free when its list is empty.
+//
+// Like the rest of the kernel's state, swap is protected by the big
+// kernel lock.  Disk transfers are synchronous, and give up if the disk
+// does not answer (see kern/ide.c).  Once a write has failed, nothing
+// more is paged out, and page_alloc fails with -E_NO_MEM as it would
+// without swap.
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/error.h>
+
+#include <kern/swap.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/merge.h>
+
+#define SECTPERPAGE	(PGSIZE / SECTSIZE)
+#define SWAP_PTE(slot)	(((slot) << PGSHIFT) | PTE_SWAP)
+
+struct Swapstat swapstat;
+
+static uint32_t swap_next;	// Where slot_alloc looks first
+static bool swap_failed;	// A write to the disk has failed
+
+// The clock hand: the page it is at, in envs[hand_envx].
+static uint32_t hand_envx;
+static uint32_t hand_vpn;
+
+void
+swap_init(void)
+{
+	uint32_t n;
+
+	ide_init();
+	n = MIN(ide_nsecs / SECTPERPAGE, PTE_SWAPSLOT(~0) + 1);
+	if (n == 0) {
+		cprintf("swap: no swap disk\n");
+		return;
+	}
+	rmap_init(n);
+	swapstat.sw_nslots = n;
+	cprintf("swap: %u pages of swap\n", n);
+}
+
+// Allocate a free slot, going on from the last one allocated so that
+// a run of page-outs is written out in order.
+// Returns the slot, or -E_NO_MEM if swap is full.
+static int
+slot_alloc(void)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < swapstat.sw_nslots; i++) {
+		slot = (swap_next + i) % swapstat.sw_nslots;
+		if (*rmap_list(SWAP_PTE(slot)) == NULL) {
+			swap_next = slot + 1;
+			swapstat.sw_inuse++;
+			return slot;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+//
+// Drop the swapped-out PTE *pte, freeing its slot if that was the last
+// PTE referring to it.  Clearing *pte is left to the caller.
+//
+void
+swap_free(pte_t *pte)
+{
+	struct Rmap **head = rmap_list(*pte);
+
+	assert(PTE_SWAPPED(*pte) && head && *head);
+	rmap_remove(pte);
+	if (*head == NULL)
+		swapstat.sw_inuse--;
+}
+
+// Write out pp, which the clock hand found mapped at 'va' in pgdir, and
+// free it, pointing every PTE that maps it at the swap slot instead.
+// Returns 0 on success, or < 0 if swap is full or the write failed, in
+// which case the page stays where it was.
+static int
+swap_out(pde_t *pgdir, void *va, struct Page *pp)
+{
+	struct Rmap **pl, **sl, *rm;
+	pte_t swpte;
+	int slot, n;
+
+	if ((slot = slot_alloc()) < 0)
+		return slot;
+	swpte = SWAP_PTE(slot);
+	pl = rmap_list(page2pa(pp) | PTE_P);
+	sl = rmap_list(swpte);
+
+	// Unmap the page first, everywhere, so that nothing can change it
+	// after it is written.
+	for (rm = *pl, n = 0; rm; rm = rm->rm_next, n++)
+		*rm->rm_pte = swpte | (*rm->rm_pte & 0xFFF & ~PTE_P);
+	*sl = *pl;
+	*pl = NULL;
+	if (n == 1 && pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_ref == 1) {
+		// Only pgdir can have it in its TLB.
+		tlb_invalidate(pgdir, va);
+		tlb_batch_flush();
+	} else
+		tlb_shootdown_all();
+
+	if (ide_write(slot * SECTPERPAGE, page2kva(pp), SECTPERPAGE) < 0) {
+		for (rm = *sl; rm; rm = rm->rm_next)
+			*rm->rm_pte = page2pa(pp)
+				| (*rm->rm_pte & 0xFFF & ~PTE_SWAP) | PTE_P;
+		*pl = *sl;
+		*sl = NULL;
+		swapstat.sw_inuse--;
+		if (!swap_failed)
+			cprintf("swap: write failed; paging out no more\n");
+		swap_failed = 1;
+		return -E_FAULT;
+	}
+	assert(pp->pp_ref == n);
+	pp->pp_ref = 0;
+	page_free(pp);
+	swapstat.sw_npageout++;
+	return 0;
+}
+
+// May pp be paged out now?  Not if any of its mappings has been used
+// since the hand last came by (they all lose PTE_A), or is PTE_SHARE,
+// or if anything other than its mappings holds it.  A reference that
+// only same-page merging holds is let go of.
+static bool
+swap_victim(struct Page *pp)
+{
+	struct Rmap *rm;
+	uint32_t n;
+	bool used = 0;
+
+	for (rm = *rmap_list(page2pa(pp) | PTE_P), n = 0; rm;
+	     rm = rm->rm_next, n++) {
+		if (*rm->rm_pte & PTE_SHARE)
+			return 0;
+		if (*rm->rm_pte & PTE_A) {
+			// A CPU that still has the page in its TLB may keep
+			// using it without setting PTE_A again; that only
+			// makes the page look idle a little early.
+			*rm->rm_pte &= ~PTE_A;
+			used = 1;
+		}
+	}
+	if (used)
+		return 0;
+	if (pp->pp_ref == n + 1)
+		merge_release(pp);
+	return pp->pp_ref == n;
+}
+
+// May the clock hand take pages from e?
+static bool
+swap_env_ok(struct Env *e)
+{
+	return (e->env_status == ENV_RUNNABLE
+		|| e->env_status == ENV_NOT_RUNNABLE)
+		&& e->env_runs > 0 && e != &envs[ENVX_FS];
+}
+
+// Move the hand over e's pages, up to page number 'end', paging out at
+// most n of them.  Returns the number paged out, or < 0 if swap_out
+// failed.
+static int
+swap_scan(struct Env *e, uint32_t end, int n)
+{
+	pde_t pde;
+	pte_t *pte;
+	struct Page *pp;
+	void *va;
+	int freed, r;
+
+	for (freed = 0; hand_vpn < end && freed < n; hand_vpn++) {
+		va = (void *) (hand_vpn << PGSHIFT);
+		pde = e->env_pgdir[PDX(va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS)) {
+			// Skip to the next page table.
+			hand_vpn = ROUNDUP(hand_vpn + 1, NPTENTRIES) - 1;
+			continue;
+		}
+
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(va);
+		swapstat.sw_nscan++;
+		if (!(*pte & PTE_P) || va == (void *) (UXSTACKTOP - PGSIZE)
+		    || rmap_list(*pte) == NULL)
+			continue;
+		pp = pa2page(PTE_ADDR(*pte));
+		if (!swap_victim(pp))
+			continue;
+		if ((r = swap_out(e->env_pgdir, va, pp)) < 0)
+			return r;
+		freed++;
+	}
+	return freed;
+}
+
+//
+// Page out up to n user pages, taking the hand at most once around.
+// Returns the number of pages freed, which is 0 if there is no swap
+// disk or it has failed.
+//
+int
+swap_reclaim(int n)
+{
+	uint32_t i, start_vpn;
+	int freed, r;
+
+	if (swapstat.sw_nslots == 0 || swap_failed)
+		return 0;
+	swapstat.sw_nreclaim++;
+
+	// Back at the environment we started in, stop where we started.
+	start_vpn = hand_vpn;
+	for (i = 0, freed = 0; i <= nenvs && freed < n; i++) {
+		if (hand_envx >= nenvs)
+			hand_envx = 0;
+		if (swap_env_ok(&envs[hand_envx])) {
+			r = swap_scan(&envs[hand_envx],
+				      i < nenvs ? VPN(UTOP) : start_vpn,
+				      n - freed);
+			if (r < 0)
+				break;
+			freed += r;
+		}
+		if (freed < n) {
+			hand_envx++;
+			hand_vpn = 0;
+		}
+	}
+	return freed;
+}
+
+//
+// If the page at 'va' in 'pgdir' is swapped out, read it back in.
+// Returns 1 if a page is mapped at va now, whether or not it had to be
+// read in, 0 if none is, or < 0 on error.  Errors are:
+//	-E_NO_MEM if there is no memory for the page.
+//	-E_FAULT if the disk could not read it; it stays swapped out.
+//
+int
+swap_in(pde_t *pgdir, void *va)
+{
+	struct Rmap **pl, **sl, *rm;
+	struct Page *pp;
+	pte_t *pte;
+	uint32_t n;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || (pte = pgdir_walk(pgdir, va, 0)) == NULL)
+		return 0;
+	if (*pte & PTE_P)
+		return 1;
+	if (!PTE_SWAPPED(*pte))
+		return 0;
+
+	if (page_alloc(&pp) < 0)
+		return -E_NO_MEM;
+	if (ide_read(PTE_SWAPSLOT(*pte) * SECTPERPAGE, page2kva(pp),
+		     SECTPERPAGE) < 0) {
+		page_free(pp);
+		return -E_FAULT;
+	}
+
+	// Map it back wherever it was mapped when it went out, even in page
+	// tables other page directories share: it is the same page there.
+	sl = rmap_list(*pte);
+	pl = rmap_list(page2pa(pp) | PTE_P);
+	for (rm = *sl, n = 0; rm; rm = rm->rm_next, n++)
+		*rm->rm_pte = page2pa(pp)
+			| (*rm->rm_pte & 0xFFF & ~PTE_SWAP) | PTE_P;
+	*pl = *sl;
+	*sl = NULL;
+	pp->pp_ref = n;
+	*pte |= PTE_A;
+	swapstat.sw_inuse--;
+	swapstat.sw_npagein++;
+	return 1;
+}
@@ -0,0 +1,33 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Pages page_alloc asks swap_reclaim for when memory runs out, so that
+// the disk sees a run of writes rather than one per allocation.
+#define SWAP_CLUSTER	32
+
+// The counts are since the kernel monitor last reset them.
+struct Swapstat {
+	uint32_t sw_nslots;	// Page-sized slots on the swap disk; 0 if none
+	uint32_t sw_inuse;	// Slots holding a page
+	uint32_t sw_nreclaim;	// Calls to swap_reclaim
+	uint32_t sw_nscan;	// PTEs the clock hand passed over
+	uint32_t sw_npageout;	// Pages written out
+	uint32_t sw_npagein;	// Pages read back in
+};
+
+extern struct Swapstat swapstat;
+
+void	swap_init(void);
+int	swap_reclaim(int n);
+int	swap_in(pde_t *pgdir, void *va);
+void	swap_free(pte_t *pte);
+
+#endif	// !JOS_KERN_SWAP_H
@@ -11,6 +11,10 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/endpoint.h>
+#include <kern/swap.h>
+#include <kern/merge.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -29,18 +33,13 @@ sys_cputs(const char *s, size_t len)
 }
 
 // Read a character from the system console.
-// Returns the character.
+// Returns the character, or 0 if none is waiting.
 static int
 sys_cgetc(void)
 {
-	int c;
-
-	// The cons_getc() primitive doesn't wait for a character,
-	// but the sys_cgetc() system call does.
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
-
-	return c;
+	// Don't wait for a character: spinning here would hold the
+	// kernel lock and stall every other CPU.
+	return cons_getc();
 }
 
 // Returns the current environment's envid.
@@ -74,6 +73,61 @@ sys_yield(void)
 	sched_yield();
 }
 
+// Deschedule current environment and run 'envid' in its place,
+// if 'envid' is runnable; otherwise pick a different one as sys_yield does.
+// Returns 0 (once the caller runs again), or < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_yield_to(envid_t envid)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield_to(e);
+}
+
+// Block the current environment for 'msec' milliseconds.
+// Returns 0.
+static int
+sys_sleep(uint32_t msec)
+{
+	if (msec == 0)
+		return 0;
+	timer_set(curenv, msec);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Block until the environment 'envid' has exited, that is, until its
+// slot is free or holds another environment.
+// Returns 0 once it has, at once if it already has, or -E_INVAL if
+// 'envid' is the current environment.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e;
+
+	if (envid == 0 || envid == curenv->env_id)
+		return -E_INVAL;
+	e = &envs[ENVX(envid)];
+	if (ENVX(envid) >= nenvs || e->env_id != envid
+	    || e->env_status == ENV_FREE)
+		return 0;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	LIST_INSERT_HEAD(&e->env_waiters, curenv, env_wait_link);
+	return 0;
+}
+
+// Return the current time in milliseconds since boot.
+static int
+sys_time_msec(void)
+{
+	return (int) timer_msec();
+}
+
 // Allocate a new environment.
 // Returns envid of new environment, or < 0 on error.  Errors are:
 //	-E_NO_FREE_ENV if no free environment is available.
@@ -94,8 +148,10 @@ sys_exofork(void)
 	if ((errno = env_alloc(&newenv, curenv->env_id)) < 0)
 		return errno;
 
-	newenv->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(newenv, ENV_NOT_RUNNABLE);
 	newenv->env_tf = curenv->env_tf;
+	newenv->env_prio = curenv->env_prio;
+	newenv->env_shares = curenv->env_shares;
 	
 	//set return value to child to 0
 	newenv->env_tf.tf_regs.reg_eax = 0;
@@ -103,6 +159,140 @@ sys_exofork(void)
 	return newenv->env_id;
 }
 
+// Can curenv's page table 'pt', for region 'pdx', be shared with a
+// child as a whole?  Not if it maps PTE_SHARE pages, which must stay
+// writable, or the exception stack, which the child does not inherit.
+static bool
+fork_pt_shareable(int pdx, pte_t *pt)
+{
+	int ptx;
+
+	for (ptx = 0; ptx < NPTENTRIES; ptx++)
+		if ((pt[ptx] & PTE_P)
+		    && ((pt[ptx] & PTE_SHARE)
+			|| PGADDR(pdx, ptx, 0) == (void *) (UXSTACKTOP - PGSIZE)))
+			return 0;
+	return 1;
+}
+
+// Give 'child' the mappings below UTOP that curenv has, the way
+// lib/fork.c's duppage does: PTE_SHARE pages stay shared, writable and
+// copy-on-write pages become copy-on-write in both environments, and
+// read-only pages are simply mapped.  The exception stack is not copied;
+// the child gets a fresh one if curenv has a page fault upcall.  Pages
+// that are swapped out stay out: the child gets a copy of the PTE, and
+// the two share the swap slot, copy-on-write.
+//
+// Where it can, fork_vm hands the child curenv's page table itself,
+// which then stays shared until one of them changes it (see
+// pgdir_unshare in kern/pmap.c).  A page table that is already shared
+// costs nothing more to share again.
+static int
+fork_vm(struct Env *child)
+{
+	pde_t *pgdir = curenv->env_pgdir;
+	struct Page *pp;
+	pte_t *pt, *cpte, pte;
+	void *va;
+	int pdx, ptx, perm, r;
+
+	r = 0;
+	for (pdx = 0; pdx < PDX(UTOP) && r == 0; pdx++) {
+		if (!(pgdir[pdx] & PTE_P))
+			continue;
+
+		// A superpage is one mapping, shared or copy-on-write whole.
+		if (pgdir[pdx] & PTE_PS) {
+			if (!(pgdir[pdx] & PTE_SHARE) && (pgdir[pdx] & PTE_W))
+				pgdir[pdx] = (pgdir[pdx] & ~PTE_W) | PTE_COW;
+			child->env_pgdir[pdx] = pgdir[pdx];
+			pa2page(PDE_PS_ADDR(pgdir[pdx]))->pp_ref++;
+			continue;
+		}
+
+		pt = KADDR(PTE_ADDR(pgdir[pdx]));
+		if (!(pgdir[pdx] & PTE_W) || fork_pt_shareable(pdx, pt)) {
+			if (pgdir[pdx] & PTE_W)
+				for (ptx = 0; ptx < NPTENTRIES; ptx++)
+					if (pt[ptx] & PTE_W)
+						pt[ptx] = (pt[ptx] & ~PTE_W) | PTE_COW;
+			pgdir[pdx] &= ~PTE_W;
+			child->env_pgdir[pdx] = pgdir[pdx];
+			pa2page(PTE_ADDR(pgdir[pdx]))->pp_ref++;
+			continue;
+		}
+
+		for (ptx = 0; ptx < NPTENTRIES && r == 0; ptx++) {
+			pte = pt[ptx];
+			va = PGADDR(pdx, ptx, 0);
+			if (PTE_SWAPPED(pte)) {
+				if ((cpte = pgdir_walk(child->env_pgdir, va, 1)) == NULL) {
+					r = -E_NO_MEM;
+					continue;
+				}
+				if (pte & (PTE_W | PTE_COW))
+					pt[ptx] = (pte & ~PTE_W) | PTE_COW;
+				r = pte_dup(cpte, &pt[ptx]);
+				continue;
+			}
+			if (!(pte & PTE_P) || va == (void *) (UXSTACKTOP - PGSIZE))
+				continue;
+			perm = pte & PTE_USER;
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[ptx] = (pte & ~PTE_W) | PTE_COW;
+			}
+			r = page_insert(child->env_pgdir,
+					pa2page(PTE_ADDR(pte)), va, perm);
+		}
+	}
+
+	// Our own writable mappings may have been write-protected:
+	// flush them all at once rather than page by page.
+	tlb_flush_local();
+	tlb_shootdown(pgdir);
+	if (r < 0)
+		return r;
+
+	if (curenv->env_pgfault_upcall) {
+		if ((r = page_alloc_zeroed(&pp)) < 0)
+			return r;
+		if ((r = page_insert(child->env_pgdir, pp,
+				     (void *) (UXSTACKTOP - PGSIZE),
+				     PTE_P | PTE_U | PTE_W)) < 0) {
+			page_free(pp);
+			return r;
+		}
+		child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	}
+	return 0;
+}
+
+// Create a copy-on-write copy of the current environment, as lib/fork.c
+// does, but in one system call.  The child starts out runnable, and
+// sees sys_fork return 0.
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM if there's no memory for the child's page tables.
+static envid_t
+sys_fork(void)
+{
+	struct Env *child;
+	envid_t envid;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	if ((r = envid2env(envid, &child, 0)) < 0)
+		panic("sys_fork: child %08x missing: %e", envid, r);
+	if ((r = fork_vm(child)) < 0) {
+		env_destroy(child);
+		return r;
+	}
+	env_set_status(child, ENV_RUNNABLE);
+	return envid;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -129,7 +319,52 @@ sys_env_set_status(envid_t envid, int status)
 	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
 		return -E_INVAL;
 	
-	penv->env_status = status;
+	env_set_status(penv, status);
+	return 0;
+}
+
+// Set envid's scheduling priority to prio.
+// An environment may not raise any environment above its own priority.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is out of range or above the caller's priority.
+static int
+sys_env_set_priority(envid_t envid, uint32_t prio)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (prio > ENV_PRIO_MAX || prio > curenv->env_prio)
+		return -E_INVAL;
+
+	sched_set_prio(e, prio);
+	return 0;
+}
+
+// Set envid's share of the CPU, relative to other environments
+// at the same priority, to 'shares'.
+// An environment may not give any environment more shares than it has.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if shares is 0, too large, or above the caller's shares.
+static int
+sys_env_set_shares(envid_t envid, uint32_t shares)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (shares == 0 || shares > ENV_SHARES_MAX || shares > curenv->env_shares)
+		return -E_INVAL;
+
+	sched_set_shares(e, shares);
 	return 0;
 }
 
@@ -183,6 +418,42 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Store envid's memory use in *em (see struct Envmem in inc/env.h).
+// Any environment may ask about any other.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_env_memstat(envid_t envid, struct Envmem *em)
+{
+	struct Env *e;
+	struct Envmem m;
+
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	user_mem_assert(curenv, em, sizeof(*em), PTE_U | PTE_W);
+
+	user_mem_stat(e, &m);
+	*em = m;
+	return 0;
+}
+
+// Turn same-page merging on if 'on' is 1, or off if it is 0, and store
+// its state in *ms unless ms is NULL (see struct Mergestat in
+// inc/syscall.h).  Other values of 'on' leave merging as it is.
+// Returns 0.
+static int
+sys_merge_stat(int on, struct Mergestat *ms)
+{
+	if (ms)
+		user_mem_assert(curenv, ms, sizeof(*ms), PTE_U | PTE_W);
+	if (on == 0 || on == 1)
+		mergestat.ms_on = on;
+	if (ms)
+		*ms = mergestat;
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -192,6 +463,14 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.
 //
+// If perm includes PTE_COW, the page is allocated lazily: 'va' maps the
+// shared zero page copy-on-write, and gets a page of its own only when
+// it is first written.
+//
+// If perm includes PTE_PS, a whole PTSIZE superpage is allocated at
+// 'va', which must be PTSIZE-aligned, replacing anything mapped there.
+// Superpages are never allocated lazily.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
@@ -220,10 +499,26 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_INVAL;
 	if (!(perm & PTE_P) || !(perm & PTE_U))
 		return -E_INVAL;
-	else if ((perm & 0xfff) & ~(PTE_P|PTE_U|PTE_W|PTE_AVAIL))
+	else if ((perm & 0xfff) & ~(PTE_P|PTE_U|PTE_W|PTE_AVAIL|PTE_PS))
 		return -E_INVAL;
 
-	if (page_alloc(&page) < 0)
+	if (perm & PTE_PS) {
+		if ((perm & PTE_COW) || (uint32_t) va % PTSIZE)
+			return -E_INVAL;
+		if (page_alloc_order(&page, PAGE_MAXORDER) < 0)
+			return -E_NO_MEM;
+		memset(page2kva(page), 0, PTSIZE);
+		if (page_insert(penv->env_pgdir, page, va, perm) < 0) {
+			page_free(page);
+			return -E_NO_MEM;
+		}
+		return 0;
+	}
+
+	if (perm & PTE_COW)
+		return page_insert_zero(penv->env_pgdir, va, perm);
+
+	if (page_alloc_zeroed(&page) < 0)
 		return -E_NO_MEM;
 
 	if (page_insert(penv->env_pgdir, page, va, perm) < 0) {
@@ -238,7 +533,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  A superpage is mapped whole: perm must include PTE_PS exactly
+// when srcva is in one, and both addresses must then be PTSIZE-aligned.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -251,6 +547,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		address space.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
+//	-E_FAULT if srcva's page is swapped out and can't be read back in.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
@@ -268,6 +565,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	struct Env *pdstenv;
 	struct Page *page;
 	pte_t * pte_ptr;
+	int r;
 
 	if (envid2env(dstenvid, &pdstenv, 1) < 0 ||
 			envid2env(srcenvid, &psrcenv, 1) < 0)
@@ -277,28 +575,35 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	if (!(perm & PTE_P) || !(perm & PTE_U))
 		return -E_INVAL;
-	else if ((perm & 0xfff) & ~(PTE_P|PTE_U|PTE_W|PTE_AVAIL))
+	else if ((perm & 0xfff) & ~(PTE_P|PTE_U|PTE_W|PTE_AVAIL|PTE_PS))
 		return -E_INVAL;
 
+	if ((r = swap_in(psrcenv->env_pgdir, srcva)) < 0)
+		return r;
 	page = page_lookup(psrcenv->env_pgdir, srcva, &pte_ptr);
 	if (!page || (perm&PTE_W && !(*pte_ptr & PTE_W)))
 		return -E_INVAL;
+	if ((perm & PTE_PS) != (*pte_ptr & PTE_PS)
+	    || ((perm & PTE_PS) && (uint32_t) srcva % PTSIZE))
+		return -E_INVAL;
 
-	if (page_insert(pdstenv->env_pgdir, page, dstva, perm) < 0) {
-		page_free(page);
-		return -E_NO_MEM;
-	}
+	// The page is still mapped at srcva, so don't free it.
+	if ((r = page_insert(pdstenv->env_pgdir, page, dstva, perm)) < 0)
+		return r;
 
 	return 0;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// If 'va' is in a superpage, the whole superpage is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if va's page table is shared after a fork, and there's
+//		no memory to make envid a copy of its own.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -313,8 +618,203 @@ sys_page_unmap(envid_t envid, void *va)
 	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE)
 		return -E_INVAL;
 
-	page_remove(penv->env_pgdir, va);
+	return page_remove(penv->env_pgdir, va);
+}
+
+// Do the n page operations in 'ops' (see inc/syscall.h) in order, in a
+// single system call.  Every operation is tried, even after one fails.
+// If 'status' is nonnull, the result of ops[i] is stored in status[i].
+//
+// Returns 0 if every operation succeeded, otherwise the error of the
+// first that failed.  Errors are as for the operations themselves, and:
+//	-E_INVAL (as the status) for an unknown op_type.
+//	-E_FAULT if ops[i] or status[i] is not accessible by the time we
+//		get to it (say, because the batch unmapped it); the
+//		operations from i on are not done.
+static int
+page_batch(const struct Pageop *ops, uint32_t n, int *status)
+{
+	struct Pageop op;
+	uint32_t i;
+	int r, first;
+
+	first = 0;
+	for (i = 0; i < n; i++) {
+		if (user_mem_check(curenv, &ops[i], sizeof(op), PTE_U) < 0)
+			return -E_FAULT;
+		op = ops[i];
+
+		switch (op.op_type) {
+		case PAGEOP_ALLOC:
+			r = sys_page_alloc(op.op_env, op.op_va, op.op_perm);
+			break;
+		case PAGEOP_MAP:
+			r = sys_page_map(op.op_env, op.op_va,
+					 op.op_dstenv, op.op_dstva, op.op_perm);
+			break;
+		case PAGEOP_UNMAP:
+			r = sys_page_unmap(op.op_env, op.op_va);
+			break;
+		default:
+			r = -E_INVAL;
+			break;
+		}
+
+		if (status) {
+			if (user_mem_check(curenv, &status[i], sizeof(int),
+					   PTE_U | PTE_W) < 0)
+				return -E_FAULT;
+			status[i] = r;
+		}
+		if (r < 0 && first == 0)
+			first = r;
+	}
+	return first;
+}
+
+// Other CPUs flush their TLBs once for the whole batch.
+static int
+sys_page_batch(const struct Pageop *ops, uint32_t n, int *status)
+{
+	int r;
+
+	tlb_batch_begin();
+	r = page_batch(ops, n, status);
+	tlb_batch_end();
+	return r;
+}
+
+// Check the page-passing arguments of an IPC send.
+// Returns 0 if they are good, or -E_INVAL.
+static int
+ipc_check(void *srcva, unsigned perm)
+{
+	if ((uintptr_t)srcva < UTOP) {
+		if ((uintptr_t)srcva % PGSIZE)
+			return -E_INVAL;
+		if (!(perm & PTE_P) || !(perm & PTE_U))
+			return -E_INVAL;
+		if ((perm & 0xfff) & ~PTE_USER)
+			return -E_INVAL;
+	}
+	return 0;
+}
+
+// Would 'dst' take a message from 'src' right now?
+static bool
+ipc_accepts(struct Env *dst, struct Env *src)
+{
+	return dst->env_ipc_recving
+		&& (!dst->env_ipc_recvfrom || dst->env_ipc_recvfrom == src->env_id);
+}
+
+// Start receiving into 'e': at 'dstva' if it is below UTOP,
+// and only from 'from' if it is nonzero.  Then e, which is waiting for
+// a reply, goes on from's env_waiters, so that env_free can fail the
+// call if 'from' exits first.
+static void
+ipc_recv_start(struct Env *e, void *dstva, envid_t from)
+{
+	e->env_ipc_recving = 1;
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_recvfrom = from;
+	e->env_ipc_value = 0;
+	e->env_ipc_perm = 0;
+	e->env_ipc_from = 0;
+	if (from)
+		LIST_INSERT_HEAD(&envs[ENVX(from)].env_waiters, e, env_wait_link);
+}
+
+// Deliver a message from 'src' to 'dst', which is receiving, and make
+// 'dst' runnable.  The message is not delivered if the page cannot be
+// transferred.
+// Returns 0 on success where no page mapping occurs,
+// 1 on success where a page mapping occurs, and < 0 on error.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    const uint32_t *words, void *srcva, unsigned perm)
+{
+	struct Page *page;
+	pte_t *pte_ptr;
+	int r;
+
+	// Transfer a page
+	dst->env_ipc_perm = 0;
+	if ((uintptr_t)srcva < UTOP && (uintptr_t)dst->env_ipc_dstva < UTOP) {
+		if ((r = swap_in(src->env_pgdir, srcva)) < 0)
+			return r;
+		if ((page = page_lookup(src->env_pgdir, srcva, &pte_ptr)) == NULL)
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pte_ptr & PTE_W))
+			return -E_INVAL;
+		if (*pte_ptr & PTE_PS)
+			return -E_INVAL;
+		if ((r = page_insert(dst->env_pgdir, page, dst->env_ipc_dstva, perm)) < 0)
+			return r;
+		dst->env_ipc_perm = perm;
+	}
+
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_winlen = 0;
+	timer_cancel(dst);
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	if (words)
+		memmove(dst->env_ipc_words, words, sizeof(dst->env_ipc_words));
+	else
+		memset(dst->env_ipc_words, 0, sizeof(dst->env_ipc_words));
+	env_set_status(dst, ENV_RUNNABLE);
+	return dst->env_ipc_perm ? 1 : 0;
+}
+
+// Park the message on 'src', which is about to block, at the end of
+// 'dst''s queue of senders.
+static void
+ipc_queue(struct Env *src, struct Env *dst, uint32_t value,
+	  const uint32_t *words, void *srcva, unsigned perm)
+{
+	src->env_ipc_sendto = dst->env_id;
+	src->env_ipc_sendval = value;
+	if (words)
+		memmove(src->env_ipc_sendwords, words,
+			sizeof(src->env_ipc_sendwords));
+	else
+		memset(src->env_ipc_sendwords, 0,
+		       sizeof(src->env_ipc_sendwords));
+	src->env_ipc_sendva = srcva;
+	src->env_ipc_sendperm = perm;
+	TAILQ_INSERT_TAIL(&dst->env_ipc_senders, src, env_ipc_link);
+}
+
+// Give 'e', which has just started receiving, the first queued message
+// it accepts.  Its sender goes on to wait for a reply if it is in
+// sys_ipc_call, and otherwise returns from sys_ipc_send.  A sender
+// whose page has gone bad gets the error instead, and we try the next.
+// Returns 1 if a message was delivered, 0 if 'e' must wait.
+static int
+ipc_take_queued(struct Env *e)
+{
+	struct Env *src, *next;
+	int r;
 
+	for (src = TAILQ_FIRST(&e->env_ipc_senders); src; src = next) {
+		next = TAILQ_NEXT(src, env_ipc_link);
+		if (!ipc_accepts(e, src))
+			continue;
+		TAILQ_REMOVE(&e->env_ipc_senders, src, env_ipc_link);
+		src->env_ipc_sendto = 0;
+		r = ipc_deliver(src, e, src->env_ipc_sendval, src->env_ipc_sendwords,
+				src->env_ipc_sendva, src->env_ipc_sendperm);
+		if (r >= 0 && src->env_ipc_calling)
+			ipc_recv_start(src, src->env_ipc_dstva, e->env_id);
+		else {
+			src->env_tf.tf_regs.reg_eax = MIN(r, 0);
+			env_set_status(src, ENV_RUNNABLE);
+		}
+		src->env_ipc_calling = 0;
+		if (r >= 0)
+			return 1;
+	}
 	return 0;
 }
 
@@ -358,55 +858,251 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	// LAB 4: Your code here.
 	//panic("sys_ipc_try_send not implemented");
 	struct Env *dstenv;
-	struct Page *page;
 	int r;
-	pte_t *pte_ptr;
 
 	if (envid2env(envid, &dstenv, 0) < 0)
 			return -E_BAD_ENV;
-	if (dstenv->env_ipc_recving == 0)
+	if (!ipc_accepts(dstenv, curenv))
 		return -E_IPC_NOT_RECV;
-	if ((uintptr_t)srcva < UTOP) {
-		if ((uintptr_t)srcva % PGSIZE)
-			return -E_INVAL;
-		if (!(perm & PTE_P) || !(perm & PTE_U))
-			return -E_INVAL;
-		if ((perm & 0xfff) & ~PTE_USER)
-			return -E_INVAL;
-	}
+	if ((r = ipc_check(srcva, perm)) < 0)
+		return r;
 
-	dstenv->env_ipc_recving = 0;
-	dstenv->env_ipc_from = curenv->env_id;
-	dstenv->env_ipc_value = value;
+	return ipc_deliver(curenv, dstenv, value, NULL, srcva, perm);
+}
 
-	// Transfer a page
-	if ((uintptr_t)(dstenv->env_ipc_dstva)<UTOP && (uintptr_t)srcva<UTOP) {
+// Send 'value', and the page at 'srcva' if srcva < UTOP, to 'envid',
+// waiting for it to receive if it is not receiving yet.
+// Senders waiting for the same receiver get through in the order they
+// started waiting, each with a single system call.
+//
+// Returns 0 once the message is delivered, or < 0 on error.
+// Errors are as for sys_ipc_try_send, except that instead of
+// -E_IPC_NOT_RECV:
+//	-E_INVAL if envid is the caller, which would wait forever.
+//	-E_BAD_ENV (eventually) if envid exits before receiving.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *dstenv;
+	int r;
 
-		// Attentions: sys_page_map will check sender and receiver's permission, so don't use it
-		//if ((r=sys_page_map(0, srcva, envid, dstenv->env_ipc_dstva, perm)) < 0)
-		//	return r;
-		if ((page = page_lookup(curenv->env_pgdir, srcva, &pte_ptr)) == NULL)
-			return -E_INVAL;
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return r;
+	if ((r = ipc_check(srcva, perm)) < 0)
+		return r;
+	if (ipc_accepts(dstenv, curenv))
+		return MIN(ipc_deliver(curenv, dstenv, value, NULL, srcva, perm), 0);
+	if (dstenv == curenv)
+		return -E_INVAL;
 
-		if ((perm & PTE_W) &&!(*pte_ptr & PTE_W))
-			panic("[WARNING] Mapping a readonly page to writable status!");
+	// Wait on the receiver's queue; sys_ipc_recv delivers the
+	// message and sets our return value.
+	ipc_queue(curenv, dstenv, value, NULL, srcva, perm);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	return 0;
+}
 
-		if ((r=page_insert(dstenv->env_pgdir, page, dstenv->env_ipc_dstva, perm)) < 0)
-			return r;
+// Accept pages granted with sys_ipc_grant into [va, va+len), with the
+// next message received.  The window closes when a message arrives.
+// Returns 0 on success, -E_INVAL if va or len is not page-aligned or
+// the window does not lie below UTOP.
+static int
+sys_ipc_window(void *va, uint32_t len)
+{
+	if ((uintptr_t) va % PGSIZE || len % PGSIZE
+	    || (uintptr_t) va > UTOP || len > UTOP - (uintptr_t) va)
+		return -E_INVAL;
+	curenv->env_ipc_winva = va;
+	curenv->env_ipc_winlen = len;
+	return 0;
+}
 
-		dstenv->env_ipc_perm = perm;
-		dstenv->env_status = ENV_RUNNABLE;
-		return 1;
+// Send 'value' to 'envid', as sys_ipc_try_send does, along with the n
+// pages described by 'grants', which are mapped into the receiver's
+// window (see sys_ipc_window).  Either every page is mapped or, on
+// error, none is.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
+//		or only receives from another environment.
+//	-E_INVAL if n > IPC_MAXGRANT, or a grant is bad as for sys_ipc_send,
+//		or it falls outside the receiver's window.
+//	-E_NO_MEM if there's not enough memory to map the pages.
+static int
+sys_ipc_grant(envid_t envid, uint32_t value, const struct Ipcgrant *grants,
+	      uint32_t n)
+{
+	// The grants are copied in, so that the sender cannot change
+	// them between checking and mapping.  They are too big for the
+	// kernel stack; static buffers are safe because the big kernel
+	// lock lets only one CPU into a system call at a time, and
+	// nothing below can block or reenter sys_ipc_grant.
+	static struct Ipcgrant g[IPC_MAXGRANT];
+	static struct Page *pp[IPC_MAXGRANT];
+	struct Env *dstenv;
+	pte_t *pte;
+	uint32_t i;
+	int r;
+
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return r;
+	if (n > IPC_MAXGRANT)
+		return -E_INVAL;
+	user_mem_assert(curenv, grants, n * sizeof(struct Ipcgrant), PTE_U);
+	memmove(g, grants, n * sizeof(struct Ipcgrant));
+	if (!ipc_accepts(dstenv, curenv))
+		return -E_IPC_NOT_RECV;
+
+	// Check every grant, and give the receiver the page tables to
+	// hold it, before mapping any.  After that, nothing can fail.
+	// Each page is held meanwhile, so that reading in or making room
+	// for the next ones cannot page it out.
+	for (i = 0; i < n; i++) {
+		if ((uintptr_t) g[i].g_srcva >= UTOP
+		    || ipc_check(g[i].g_srcva, g[i].g_perm) < 0
+		    || g[i].g_dstoff % PGSIZE
+		    || g[i].g_dstoff >= dstenv->env_ipc_winlen) {
+			r = -E_INVAL;
+			break;
+		}
+		if ((r = swap_in(curenv->env_pgdir, g[i].g_srcva)) < 0)
+			break;
+		if ((pp[i] = page_lookup(curenv->env_pgdir, g[i].g_srcva, &pte)) == NULL
+		    || ((g[i].g_perm & PTE_W) && !(*pte & PTE_W))
+		    || (*pte & PTE_PS)) {
+			r = -E_INVAL;
+			break;
+		}
+		pp[i]->pp_ref++;
+		if (!pgdir_walk(dstenv->env_pgdir,
+				dstenv->env_ipc_winva + g[i].g_dstoff, 1)) {
+			page_decref(pp[i]);
+			r = -E_NO_MEM;
+			break;
+		}
+	}
+	if (i < n) {
+		while (i-- > 0)
+			page_decref(pp[i]);
+		return r;
+	}
+
+	for (i = 0; i < n; i++) {
+		r = page_insert(dstenv->env_pgdir, pp[i],
+				dstenv->env_ipc_winva + g[i].g_dstoff,
+				g[i].g_perm);
+		assert(r == 0);
+		page_decref(pp[i]);
+	}
+	ipc_deliver(curenv, dstenv, value, NULL, (void *) UTOP, 0);
+	return 0;
+}
+
+// Send a request to 'envid' as sys_ipc_send does, along with the
+// message words 'words' if they are nonnull, then wait for its
+// reply, accepting messages from no one else.  The reply is received
+// as by sys_ipc_recv, with a page mapped at 'dstva' if dstva < UTOP.
+// The server runs in our place right away if it was waiting for us.
+//
+// Returns 0 once the reply arrives, or < 0 on error.  Errors are as for
+// sys_ipc_send, and:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_BAD_ENV (eventually) if envid exits before replying.
+static int
+ipc_call(envid_t envid, uint32_t value, const uint32_t *words,
+	 void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *dstenv;
+	int r;
 
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return r;
+	if ((r = ipc_check(srcva, perm)) < 0)
+		return r;
+	if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE)
+		return -E_INVAL;
+	if (dstenv == curenv)
+		return -E_INVAL;
+
+	if (ipc_accepts(dstenv, curenv)) {
+		if ((r = ipc_deliver(curenv, dstenv, value, words,
+				       srcva, perm)) < 0)
+			return r;
+		ipc_recv_start(curenv, dstva, dstenv->env_id);
 	} else {
-		
-		//not transfer a page
-		dstenv->env_ipc_perm = 0;
+		// Start waiting for the reply once the server takes
+		// the request off its queue.
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_calling = 1;
+		ipc_queue(curenv, dstenv, value, words, srcva, perm);
 	}
 
-	dstenv->env_status = ENV_RUNNABLE;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield_to(dstenv);
+}
 
-	return 0;
+// A call whose request and reply may each carry a page.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	return ipc_call(envid, value, NULL, srcva, perm, dstva);
+}
+
+// Like sys_ipc_call, but send the words w1..w3 along with 'value',
+// and no page, and receive no page with the reply.  The words arrive in
+// the receiver's env_ipc_words.  Short requests go this way so that
+// neither side has to map a request page.
+static int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		   uint32_t w3)
+{
+	uint32_t words[IPC_NWORDS] = { w1, w2, w3 };
+
+	return ipc_call(envid, value, words, (void *) UTOP, 0, (void *) UTOP);
+}
+
+// Reply to 'envid', unless it is 0, then receive the next request as
+// sys_ipc_recv does (with no timeout).
+// If no request is queued, the client runs in our place right away.
+//
+// Returns 0 once a request arrives, or < 0 on error, in which case no
+// reply was sent and nothing is received.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_IPC_NOT_RECV if envid is not receiving from us (yet).
+//	Otherwise as for sys_ipc_try_send.
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva,
+		   unsigned perm, void *dstva)
+{
+	struct Env *dstenv = NULL;
+	int r;
+
+	if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE)
+		return -E_INVAL;
+
+	if (envid) {
+		if ((r = envid2env(envid, &dstenv, 0)) < 0)
+			return r;
+		if (!ipc_accepts(dstenv, curenv))
+			return -E_IPC_NOT_RECV;
+		if ((r = ipc_check(srcva, perm)) < 0
+		    || (r = ipc_deliver(curenv, dstenv, value, NULL,
+					srcva, perm)) < 0)
+			return r;
+	}
+
+	ipc_recv_start(curenv, dstva, 0);
+	if (ipc_take_queued(curenv))
+		return 0;
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	if (dstenv == NULL)
+		return 0;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield_to(dstenv);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -416,12 +1112,18 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If a sender is already waiting in sys_ipc_send, take its message
+// at once instead of blocking.
+//
+// If 'timeout' is nonzero, give up after that many milliseconds.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT (eventually) if no value arrived within 'timeout' msec.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t timeout)
 {
 	// LAB 4: Your code here.
 	//panic("sys_ipc_recv not implemented");
@@ -434,13 +1136,68 @@ sys_ipc_recv(void *dstva)
 	if ((uint32_t)dstva<UTOP && (uint32_t)dstva%PGSIZE)
 		return -E_INVAL;
 
-	penv->env_ipc_recving = 1;
-	penv->env_ipc_dstva = dstva;
-	penv->env_ipc_value = 0;
-	penv->env_ipc_perm = 0;
-	penv->env_ipc_from = 0;
-	penv->env_status = ENV_NOT_RUNNABLE;
+	ipc_recv_start(penv, dstva, 0);
+	if (ipc_take_queued(penv))
+		return 0;
+
+	if (timeout)
+		timer_set(penv, timeout);
+	env_set_status(penv, ENV_NOT_RUNNABLE);
+
+	return 0;
+}
+
+// Create an endpoint that the current environment receives from.
+// Returns its epid, or -E_NO_MEM if there are no free endpoints.
+static int
+sys_ep_create(void)
+{
+	return ep_alloc(curenv);
+}
+
+// Destroy one of the current environment's endpoints.
+// Messages still in it are lost.
+// Returns 0 on success, -E_INVAL if epid is not ours.
+static int
+sys_ep_destroy(epid_t epid)
+{
+	return ep_destroy(curenv, epid);
+}
+
+// Post 'value' and the words w1..w3 to the endpoint 'epid', without
+// waiting for its owner to receive them.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if epid is not an endpoint.
+//	-E_EP_FULL if the endpoint already holds EP_RING messages.
+static int
+sys_ep_post(epid_t epid, uint32_t value, uint32_t w1, uint32_t w2,
+	    uint32_t w3)
+{
+	uint32_t words[IPC_NWORDS] = { w1, w2, w3 };
+
+	return ep_post(curenv, epid, value, words);
+}
+
+// Receive up to n messages from the endpoint 'epid', which the current
+// environment must own, into the array 'msgs'.
+// If the endpoint is empty, block until something is posted to it.
+//
+// Returns the number of messages received, or 0 after blocking, in
+// which case the caller should try again.
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if epid is not ours, or n is 0 or more than EP_RING.
+static int
+sys_ep_recv(epid_t epid, struct Epmsg *msgs, uint32_t n)
+{
+	int r;
+
+	if (n == 0 || n > EP_RING)
+		return -E_INVAL;
+	user_mem_assert(curenv, msgs, n * sizeof(struct Epmsg), PTE_U | PTE_W);
 
+	if ((r = ep_recv(curenv, epid, msgs, n)) != 0)
+		return r;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
 	return 0;
 }
 
@@ -471,6 +1228,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			sys_yield();
 			return 0;
 
+		case SYS_yield_to:
+			return sys_yield_to((envid_t) a1);
+
 		case SYS_page_alloc:
 			return (int32_t) sys_page_alloc((envid_t) a1, (void *) a2, (int) a3);
 
@@ -481,22 +1241,81 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_page_unmap:
 			return (int32_t) sys_page_unmap((envid_t) a1, (void *) a2);
 
+		case SYS_page_batch:
+			return sys_page_batch((const struct Pageop *) a1, a2,
+					      (int *) a3);
+
 		case SYS_exofork:
 			return (int32_t) sys_exofork();
 
+		case SYS_fork:
+			return (int32_t) sys_fork();
+
 		case SYS_env_set_status:
 			return (int32_t) sys_env_set_status((envid_t) a1, (int) a2);
 
+		case SYS_env_set_priority:
+			return (int32_t) sys_env_set_priority((envid_t) a1, (uint32_t) a2);
+
+		case SYS_env_set_shares:
+			return (int32_t) sys_env_set_shares((envid_t) a1, (uint32_t) a2);
+
 		case SYS_env_set_trapframe:
 			return (int32_t) sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
 		case SYS_env_set_pgfault_upcall:
 			return (int32_t) sys_env_set_pgfault_upcall((envid_t) a1, (void *) a2);
 
+		case SYS_env_memstat:
+			return (int32_t) sys_env_memstat((envid_t) a1, (struct Envmem *) a2);
+
+		case SYS_env_wait:
+			return sys_env_wait((envid_t) a1);
+
+		case SYS_merge_stat:
+			return sys_merge_stat(a1, (struct Mergestat *) a2);
+
 		case SYS_ipc_try_send:
 			return (int32_t) sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
 
+		case SYS_ipc_send:
+			return sys_ipc_send((envid_t) a1, a2, (void *) a3, a4);
+
+		case SYS_ipc_call:
+			return sys_ipc_call((envid_t) a1, a2, (void *) a3, a4, (void *) a5);
+
+		case SYS_ipc_call_words:
+			return sys_ipc_call_words((envid_t) a1, a2, a3, a4, a5);
+
+		case SYS_ipc_window:
+			return sys_ipc_window((void *) a1, a2);
+
+		case SYS_ipc_grant:
+			return sys_ipc_grant((envid_t) a1, a2,
+					     (const struct Ipcgrant *) a3, a4);
+
+		case SYS_ep_create:
+			return sys_ep_create();
+
+		case SYS_ep_destroy:
+			return sys_ep_destroy((epid_t) a1);
+
+		case SYS_ep_post:
+			return sys_ep_post((epid_t) a1, a2, a3, a4, a5);
+
+		case SYS_ep_recv:
+			return sys_ep_recv((epid_t) a1, (struct Epmsg *) a2, a3);
+
+		case SYS_ipc_reply_recv:
+			return sys_ipc_reply_recv((envid_t) a1, a2, (void *) a3, a4, (void *) a5);
+
 		case (int32_t) SYS_ipc_recv:
-			return sys_ipc_recv((void *) a1);
+			return sys_ipc_recv((void *) a1, a2);
+
+		case SYS_sleep:
+			return sys_sleep(a1);
+
+		case SYS_time_msec:
+			return sys_time_msec();
 
 		default:
 			return -E_INVAL;
@@ -0,0 +1,237 @@
+// Kernel timers.
+//
+// An environment blocked in sys_sleep or a timed sys_ipc_recv sits on a
+// hashed timing wheel, keyed on its deadline, until the deadline passes.
+// The boot CPU fires expired timers.  No CPU takes periodic timer
+// interrupts: each arms a one-shot timer for the end of the current
+// environment's quantum or the next deadline, whichever is sooner, and
+// an idle CPU with nothing to wait for arms nothing at all.  Background
+// work that is due later, such as the next same-page merging pass, asks
+// the boot CPU to wake up for it with timer_wake.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+
+#include <kern/timer.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+
+// Wheel slot i holds the timers whose deadline, in msec, is congruent
+// to i mod NWHEEL.  NWHEEL must be a power of 2.
+#define NWHEEL		256
+
+LIST_HEAD(Timer_list, Env);
+
+static struct Timer_list wheel[NWHEEL];
+static uint64_t wheel_now;	// Every deadline before this has fired
+static uint64_t wheel_next;	// No deadline is before this
+static uint32_t wheel_count;	// Number of pending timers
+static uint64_t wake_next;	// When background work is due, or 0
+
+static uint64_t tsc_per_msec;
+static uint64_t boot_tsc;
+
+struct Timepage *timepage;
+
+void
+timer_init(void)
+{
+	uint64_t mult;
+	uint32_t shift;
+
+	// Calibrate the TSC, our clock, against the 8253.
+	boot_tsc = read_tsc();
+	kclock_delay(10000);
+	tsc_per_msec = (read_tsc() - boot_tsc) / 10;
+	if (tsc_per_msec == 0)
+		tsc_per_msec = 1;
+
+	// Nanoseconds per cycle as a fixed-point fraction, with as many
+	// fraction bits as fit in 32 bits.
+	for (shift = 32; shift > 0; shift--) {
+		mult = (1000000ULL << shift) / tsc_per_msec;
+		if (mult <= 0xFFFFFFFF)
+			break;
+	}
+
+	timepage->tp_seq++;
+	timepage->tp_mult = mult;
+	timepage->tp_shift = shift;
+	timepage->tp_tsc_khz = tsc_per_msec;
+	timepage->tp_boot_tsc = boot_tsc;
+	timepage->tp_seq++;
+
+	wheel_now = timer_msec();
+}
+
+// Milliseconds since boot.
+uint64_t
+timer_msec(void)
+{
+	return (read_tsc() - boot_tsc) / tsc_per_msec;
+}
+
+// Microseconds since boot.
+uint64_t
+timer_usec(void)
+{
+	uint64_t t = read_tsc() - boot_tsc;
+
+	return t / tsc_per_msec * 1000 + t % tsc_per_msec * 1000 / tsc_per_msec;
+}
+
+// Make e runnable again 'msec' milliseconds from now,
+// replacing any timer it already has.
+void
+timer_set(struct Env *e, uint32_t msec)
+{
+	timer_cancel(e);
+
+	e->env_timeout = timer_msec() + msec;
+	if (e->env_timeout < wheel_now)
+		e->env_timeout = wheel_now;
+	LIST_INSERT_HEAD(&wheel[e->env_timeout & (NWHEEL - 1)], e, env_timer_link);
+	if (wheel_count++ == 0 || e->env_timeout < wheel_next)
+		wheel_next = e->env_timeout;
+
+	// The boot CPU may be halted, or waiting for a later deadline;
+	// make it look again.
+	if (thiscpu != bootcpu && lapic
+	    && (!bootcpu->cpu_timer || e->env_timeout < bootcpu->cpu_timer))
+		lapic_ipi(bootcpu->cpu_apicid, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+// Have the boot CPU get control at 'when', in msec since boot, even if
+// it has nothing else to do then, so that it can do background work.
+void
+timer_wake(uint64_t when)
+{
+	if (wake_next && wake_next <= when)
+		return;
+	wake_next = when;
+	if (thiscpu != bootcpu && lapic
+	    && (!bootcpu->cpu_timer || when < bootcpu->cpu_timer))
+		lapic_ipi(bootcpu->cpu_apicid, IRQ_OFFSET + IRQ_WAKEUP);
+}
+
+// Remove e's timer, if it has one.
+// wheel_next may be left early, which costs at most a spurious interrupt.
+void
+timer_cancel(struct Env *e)
+{
+	if (!e->env_timeout)
+		return;
+	LIST_REMOVE(e, env_timer_link);
+	e->env_timeout = 0;
+	wheel_count--;
+}
+
+bool
+timer_pending(void)
+{
+	return wheel_count > 0;
+}
+
+// e's deadline has passed: wake it up.
+// An IPC receive that timed out returns -E_TIMEOUT; a sleep returns 0.
+static void
+timer_fire(struct Env *e)
+{
+	timer_cancel(e);
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	env_set_status(e, ENV_RUNNABLE);
+}
+
+// Fire every timer whose deadline has passed, turning the wheel one
+// slot per elapsed millisecond, and find the next deadline.
+static void
+timer_expire(void)
+{
+	struct Env *e, *next;
+	uint64_t now, t;
+	uint32_t i, n;
+
+	now = timer_msec();
+	if (now < wheel_now)
+		return;
+	n = MIN(now - wheel_now + 1, NWHEEL);
+	for (i = 0; i < n && wheel_count; i++)
+		for (e = LIST_FIRST(&wheel[(wheel_now + i) & (NWHEEL - 1)]); e; e = next) {
+			next = LIST_NEXT(e, env_timer_link);
+			if (e->env_timeout <= now)
+				timer_fire(e);
+		}
+	wheel_now = now + 1;
+
+	// The first slot holding a timer for its own millisecond has the
+	// next deadline.  If there is none in a whole turn of the wheel,
+	// wake up after a turn and look again.
+	if (!wheel_count)
+		return;
+	for (i = 0; i < NWHEEL; i++) {
+		t = wheel_now + i;
+		LIST_FOREACH(e, &wheel[t & (NWHEEL - 1)], env_timer_link)
+			if (e->env_timeout == t) {
+				wheel_next = t;
+				return;
+			}
+	}
+	wheel_next = wheel_now + NWHEEL;
+}
+
+// Arm this CPU's timer for when it next needs to get control: the end
+// of a quantum if it is about to run an environment, and on the boot
+// CPU the next deadline or timer_wake time.  An earlier interrupt that
+// is already armed stays armed, so that system calls do not stretch
+// the quantum.
+void
+timer_arm(bool running)
+{
+	struct Cpu *c = thiscpu;
+	uint64_t now, when;
+
+	now = timer_msec();
+	when = running ? now + TIMER_QUANTUM : 0;
+	if (c == bootcpu && wheel_count && (!when || wheel_next < when))
+		when = wheel_next;
+	if (c == bootcpu && wake_next && (!when || wake_next < when))
+		when = wake_next;
+
+	if (!when) {
+		// Tickless: nothing to wait for.
+		if (c->cpu_timer) {
+			if (lapic)
+				lapic_timer_stop();
+			else
+				kclock_stop();
+			c->cpu_timer = 0;
+		}
+		return;
+	}
+	if (c->cpu_timer && c->cpu_timer <= when)
+		return;
+
+	when = when > now ? when - now : 1;
+	if (lapic)
+		when = lapic_timer_oneshot(when);
+	else
+		when = kclock_oneshot(when);
+	c->cpu_timer = now + when;
+}
+
+// Handle a timer interrupt on this CPU.
+void
+timer_intr(void)
+{
+	thiscpu->cpu_timer = 0;
+	if (thiscpu == bootcpu) {
+		timer_expire();
+		if (wake_next && wake_next <= timer_msec())
+			wake_next = 0;
+	}
+}
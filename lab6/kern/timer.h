@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+#include <inc/time.h>
+
+// Longest an environment runs before the timer preempts it, in msec.
+#define TIMER_QUANTUM	10
+
+// The page published at UTIME; allocated by i386_vm_init.
+extern struct Timepage *timepage;
+
+void timer_init(void);
+uint64_t timer_msec(void);
+uint64_t timer_usec(void);
+
+void timer_set(struct Env *e, uint32_t msec);
+void timer_cancel(struct Env *e);
+bool timer_pending(void);
+void timer_wake(uint64_t when);
+
+void timer_arm(bool running);
+void timer_intr(void);
+
+#endif	// !JOS_KERN_TIMER_H
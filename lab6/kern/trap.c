@@ -11,8 +11,10 @@
 #include <kern/sched.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
-
-static struct Taskstate ts;
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/swap.h>
 
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
@@ -54,6 +56,12 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_TLBFLUSH)
+		return "TLB Shootdown";
+	if (trapno == IRQ_OFFSET + IRQ_WAKEUP)
+		return "Wakeup";
+	if (trapno == IRQ_OFFSET + IRQ_ERROR || trapno == IRQ_OFFSET + IRQ_SPURIOUS)
+		return "Local APIC Interrupt";
 	return "(unknown trap)";
 }
 
@@ -104,6 +112,10 @@ idt_init(void)
 	extern void irq13_handler();
 	extern void irq14_handler();
 	extern void irq15_handler();
+	extern void irq_tlbflush_handler();
+	extern void irq_wakeup_handler();
+	extern void irq_error_handler();
+	extern void irq_spurious_handler();
 
 	SETGATE(idt[T_DIVIDE], 1, GD_KT, trap_divide, 0);
 	SETGATE(idt[T_DEBUG], 1, GD_KT, trap_debug, 0);
@@ -147,18 +159,35 @@ idt_init(void)
 	SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, irq14_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, irq15_handler, 0);
 
+	//Local APIC vectors
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLBFLUSH], 0, GD_KT, irq_tlbflush_handler, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, irq_wakeup_handler, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irq_error_handler, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irq_spurious_handler, 0);
+
+	// Per-CPU setup
+	idt_init_percpu();
+}
+
+// Initialize and load the per-CPU TSS and IDT
+void
+idt_init_percpu(void)
+{
+	struct Cpu *c = thiscpu;
+	int i = c->cpu_id;
+
 	// Setup a TSS so that we get the right stack
-	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	// when we trap to the kernel on this CPU.
+	c->cpu_ts.ts_esp0 = KSTACKTOP_CPU(i);
+	c->cpu_ts.ts_ss0 = GD_KD;
 
-	// Initialize the TSS field of the gdt.
-	gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	// Initialize this CPU's TSS field of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) (&c->cpu_ts),
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS
-	ltr(GD_TSS);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
@@ -215,9 +244,26 @@ trap_dispatch(struct Trapframe *tf)
 			return;
 	}
 
+	// Spurious interrupts from the local APIC need no EOI.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SPURIOUS)
+		return;
+
+	// Another CPU has work for us; trap() will go look for it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+		lapic_eoi();
+		return;
+	}
+
+	// Device and local APIC timer interrupts arrive through the local
+	// APIC when there is one; acknowledge them before anything else,
+	// since the timer handler does not return.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS)
+		lapic_eoi();
+
 	// Handle clock and serial interrupts.
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET+IRQ_TIMER) {
+		timer_intr();
 		if(tf->tf_cs == GD_KT) {
 			return;
 		}
@@ -247,12 +293,36 @@ trap_dispatch(struct Trapframe *tf)
 void
 trap(struct Trapframe *tf)
 {
+	// A TLB shootdown needs no kernel state, and the CPU asking for
+	// it holds the kernel lock, so answer before trying to take it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLBFLUSH) {
+		tlb_shootdown_ack();
+		lapic_eoi();
+		return;
+	}
+
+	// Re-acquire the big kernel lock if we were halted in
+	// sched_yield()
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		lock_kernel();
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		// Acquire the big kernel lock before doing any
+		// serious kernel work.
+		lock_kernel();
+		assert(curenv);
+
+		// Garbage collect if current environment is a zombie
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
+
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
-		assert(curenv);
 		curenv->env_tf = *tf;
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
@@ -288,6 +358,18 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Writes to copy-on-write pages are ours to resolve; the upcall
+	// only sees them if we run out of memory.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+	    && page_cow(curenv->env_pgdir, (void *) fault_va) == 0)
+		return;
+
+	// So are touches of pages that were swapped out.  The page may be
+	// back already, if another CPU faulted on it first.
+	if (!(tf->tf_err & FEC_PR)
+	    && swap_in(curenv->env_pgdir, (void *) fault_va) > 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -170,6 +170,7 @@ close_all(void)
 int
 dup(int oldfdnum, int newfdnum)
 {
+	static struct Pagebatch batch;
 	int i, r;
 	char *ova, *nva;
 	pte_t pte;
@@ -188,24 +189,26 @@ dup(int oldfdnum, int newfdnum)
 	if (vpd[PDX(ova)]) {
 		for (i = 0; i < PTSIZE; i += PGSIZE) {
 			pte = vpt[VPN(ova + i)];
-			if (pte&PTE_P) {
-				// should be no error here -- pd is already allocated
-				if ((r = sys_page_map(0, ova + i, 0, nva + i, pte & PTE_USER)) < 0)
-					goto err;
-			}
+			if (pte&PTE_P)
+				batch_page_map(&batch, 0, ova + i, 0, nva + i, pte & PTE_USER);
 		}
 	}
 
 	// change for avoid update race in lab6 exercise 5
-	if ((r = sys_page_map(0, oldfd, 0, newfd, vpt[VPN(oldfd)] & PTE_USER)) < 0)
+	// (the Fd page is mapped last, after all of the data)
+	batch_page_map(&batch, 0, oldfd, 0, newfd, vpt[VPN(oldfd)] & PTE_USER);
+	if ((r = batch_flush(&batch)) < 0)
 		goto err;
 
 	return newfdnum;
 
 err:
-	sys_page_unmap(0, newfd);
-	for (i = 0; i < PTSIZE; i += PGSIZE)
-		sys_page_unmap(0, nva + i);
+	batch_page_unmap(&batch, 0, newfd);
+	if (vpd[PDX(nva)] & PTE_P)
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (vpt[VPN(nva + i)] & PTE_P)
+				batch_page_unmap(&batch, 0, nva + i);
+	batch_flush(&batch);
 	return r;
 }
 
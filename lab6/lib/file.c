@@ -177,23 +177,17 @@ file_trunc(struct Fd *fd, off_t newsize)
 // when the size of the file as mapped in our memory increases.
 // Harmlessly does nothing if oldsize >= newsize.
 // Returns 0 on success, < 0 on error.
-// If there is an error, unmaps any newly allocated pages.
+// The server maps all the new pages in one go, or none of them.
 static int
 fmap(struct Fd* fd, off_t oldsize, off_t newsize)
 {
-	size_t i;
-	char *va;
-	int r;
+	off_t start;
 
-	va = fd2data(fd);
-	for (i = ROUNDUP(oldsize, PGSIZE); i < newsize; i += PGSIZE) {
-		if ((r = fsipc_map(fd->fd_file.id, i, va + i)) < 0) {
-			// unmap anything we may have mapped so far
-			funmap(fd, i, oldsize, 0);
-			return r;
-		}
-	}
-	return 0;
+	start = ROUNDUP(oldsize, PGSIZE);
+	if (start >= newsize)
+		return 0;
+	return fsipc_map(fd->fd_file.id, start, newsize - start,
+			 fd2data(fd) + start);
 }
 
 // Unmap any file pages that no longer represent valid file pages
@@ -202,6 +196,7 @@ fmap(struct Fd* fd, off_t oldsize, off_t newsize)
 static int
 funmap(struct Fd* fd, off_t oldsize, off_t newsize, bool dirty)
 {
+	static struct Pagebatch batch;
 	size_t i;
 	char *va;
 	int r, ret;
@@ -219,8 +214,9 @@ funmap(struct Fd* fd, off_t oldsize, off_t newsize, bool dirty)
 			    && (vpt[VPN(va + i)] & PTE_D)
 			    && (r = fsipc_dirty(fd->fd_file.id, i)) < 0)
 				ret = r;
-			sys_page_unmap(0, va + i);
+			batch_page_unmap(&batch, 0, va + i);
 		}
+	batch_flush(&batch);
   	return ret;
 }
 
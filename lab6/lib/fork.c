@@ -3,53 +3,8 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
-//
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
-//
-static void
-pgfault(struct UTrapframe *utf)
-{
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-	int r;
-
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	// Hint:
-	//   Use the read-only page table mappings at vpt
-	//   (see <inc/memlayout.h>).
-
-	// LAB 4: Your code here.
-	/*cprintf("[DEBUG] Error code %08x addr %08x\n", err, addr);*/
-	if (!(err & FEC_WR))
-		panic("pgfault: FEC_WR check error");
-	if (!(vpt[VPN(addr)] & PTE_COW))
-		panic("pgfault: PTE_COW check error va %08x  eip %08x\n", vpt[VPN(addr)], utf->utf_eip);
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	// Hint:
-	//   You should make three system calls.
-	//   No need to explicitly delete the old page's mapping.
-	
-	// LAB 4: Your code here.
-	
-	//panic("pgfault not implemented");
-	if ((r=sys_page_alloc(0, PFTEMP, PTE_W|PTE_U|PTE_P)) < 0)
-		panic("pgfault: page alloc %e", r);
-
-	memmove(PFTEMP, (void *)ROUNDDOWN(addr, PGSIZE), PGSIZE);
-
-	if((r=sys_page_map(0, PFTEMP, 0, (void *)ROUNDDOWN(addr, PGSIZE), PTE_P|PTE_W|PTE_U)) < 0)
-		panic("pgfault: page map %e", r);
-	if ((r=sys_page_unmap(0, PFTEMP)) < 0)
-		panic("pgfault: page umap %e", r);
-}
+// Mappings for the child, sent to the kernel a batch at a time.
+static struct Pagebatch batch;
 
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
@@ -58,13 +13,11 @@ pgfault(struct UTrapframe *utf)
 // marked copy-on-write as well.  (Exercise: Why mark ours copy-on-write again
 // if it was already copy-on-write?)
 //
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
+// The mappings are only queued on 'batch'; errors come from batch_flush.
 // 
-static int
+static void
 duppage(envid_t envid, unsigned pn)
 {
-	int r;
 	void *addr;
 	pte_t pte;
 
@@ -73,32 +26,52 @@ duppage(envid_t envid, unsigned pn)
 	pte = vpt[pn];
 	addr = (void *) (pn << PGSHIFT);
 
+	// A swapped-out page keeps its flags, and the kernel reads it
+	// back in when we map it.
+	if (PTE_SWAPPED(pte))
+		pte = (pte & ~PTE_SWAP) | PTE_P;
+
 	////////////////////////////////////////
 	// Add dealing with PTE_SHARE in lab 6
 	if (pte & PTE_SHARE) {
-		if ((r=sys_page_map(0, addr, envid, addr, pte & PTE_USER)) < 0)
-			return r;
+		batch_page_map(&batch, 0, addr, envid, addr, pte & PTE_USER);
 	} else 	if ((pte & PTE_W) || (pte & PTE_COW)) {
-		if ((r=sys_page_map(0, addr, envid, addr, PTE_U|PTE_P|PTE_COW)) < 0)
-			return r;
-		if ((r=sys_page_map(0, addr, 0, addr, PTE_U|PTE_P|PTE_COW)) < 0)
-			return r;
+		batch_page_map(&batch, 0, addr, envid, addr, PTE_U|PTE_P|PTE_COW);
+		batch_page_map(&batch, 0, addr, 0, addr, PTE_U|PTE_P|PTE_COW);
 	} else {
 		//////////////////////////////////////////////////////////
 		//				Why reach here
 		cprintf("[DEBUG] Reach here %08x\n", pte);
-		if ((r=sys_page_map(0, addr, envid, addr, pte & PTE_USER)) < 0)
-			return r;
+		batch_page_map(&batch, 0, addr, envid, addr, pte & PTE_USER);
 	}
-	
-	return 0;
+}
+
+//
+// Like duppage, for the superpage that maps the whole region 'pdex'.
+// Its PDE holds the flags, and vpt[] shows its contents instead of PTEs.
+//
+static void
+dupsuperpage(envid_t envid, unsigned pdex)
+{
+	void *addr;
+	pde_t pde;
+
+	pde = vpd[pdex];
+	addr = PGADDR(pdex, 0, 0);
+
+	if (!(pde & PTE_SHARE) && (pde & (PTE_W | PTE_COW))) {
+		batch_page_map(&batch, 0, addr, envid, addr, PTE_U|PTE_P|PTE_COW|PTE_PS);
+		batch_page_map(&batch, 0, addr, 0, addr, PTE_U|PTE_P|PTE_COW|PTE_PS);
+	} else
+		batch_page_map(&batch, 0, addr, envid, addr, (pde & PTE_USER) | PTE_PS);
 }
 
 //
 // User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
+// The kernel resolves faults on copy-on-write pages by itself, so the
+// child needs an exception stack only if we installed a handler.
 // Then mark the child as runnable and return.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
@@ -110,8 +83,11 @@ duppage(envid_t envid, unsigned pn)
 //   Neither user exception stack should ever be marked copy-on-write,
 //   so you must allocate a new page for the child's user exception stack.
 //
+// fork() does all of this in the kernel with sys_fork; ufork() stays
+// for kernels without it, and to compare against.
+//
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	//panic("fork not implemented");
@@ -119,24 +95,26 @@ fork(void)
 	uint32_t pdex, ptex, pn;
 	extern unsigned char end[];
 	int r;
-	extern void _pgfault_upcall(void);
-	
-	set_pgfault_handler(pgfault);
 
 	if ((newenvid = sys_exofork()) < 0) 
 		panic("fork: sys_exofork %e", newenvid);
 
 	if (newenvid == 0) {
 		env = &envs[ENVX(sys_getenvid())];
+		// Our copy of the batch holds whatever the parent had
+		// queued when it shared the page with us.
+		batch.pb_n = batch.pb_err = 0;
 		return 0;
 	}
 
 	
 	for (pdex = PDX(UTEXT); pdex <= PDX(USTACKTOP); pdex++) {
-		if (vpd[pdex] & (PTE_P)) {
+		if ((vpd[pdex] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+			dupsuperpage(newenvid, pdex);
+		else if (vpd[pdex] & (PTE_P)) {
 			for (ptex = 0; ptex < NPTENTRIES; ptex++) {
 				pn = (pdex<<10) + ptex;
-				if((pn<VPN(UXSTACKTOP-PGSIZE))&&(vpt[pn]&PTE_P)) {
+				if((pn<VPN(UXSTACKTOP-PGSIZE))&&((vpt[pn]&PTE_P)||PTE_SWAPPED(vpt[pn]))) {
 						duppage(newenvid, pn);
 				}
 			}
@@ -154,15 +132,14 @@ fork(void)
 	/*}*/
 
 
-	if ((r=sys_page_alloc(newenvid, (void *) (UXSTACKTOP-PGSIZE), PTE_P|PTE_W|PTE_U)) < 0)
+	// The child's exception stack is its own, and starts out empty.
+	if (env->env_pgfault_upcall)
+		batch_page_alloc(&batch, newenvid, (void *) (UXSTACKTOP-PGSIZE),
+				 PTE_P|PTE_W|PTE_U);
+	if ((r=batch_flush(&batch)) < 0)
 		return r;
-	if ((r=sys_page_map(newenvid, (void *) (UXSTACKTOP-PGSIZE), 
-					0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-		return r;
-	memmove(UTEMP, (void *) (UXSTACKTOP-PGSIZE), PGSIZE);
-	if ((r=sys_page_unmap(0, UTEMP)) < 0) 
-		return r;
-	if ((r=sys_env_set_pgfault_upcall(newenvid, _pgfault_upcall)) < 0)
+	if (env->env_pgfault_upcall
+	    && (r=sys_env_set_pgfault_upcall(newenvid, env->env_pgfault_upcall)) < 0)
 		return r;
 	if ((r=sys_env_set_status(newenvid, ENV_RUNNABLE)) < 0)
 		return r;
@@ -170,6 +147,33 @@ fork(void)
 	return newenvid;
 }
 
+// ufork, but with each mapping sent to the kernel in a system call of
+// its own, to measure what batching them saves.
+envid_t
+ufork_unbatched(void)
+{
+	envid_t envid;
+
+	batch.pb_max = 1;
+	envid = ufork();
+	batch.pb_max = 0;
+	return envid;
+}
+
+// Fork with a single system call.  Falls back to ufork if the kernel
+// has no sys_fork.
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork()) == 0)
+		env = &envs[ENVX(sys_getenvid())];
+	else if (envid == -E_INVAL)
+		return ufork();
+	return envid;
+}
+
 // Challenge!
 int
 sfork(void)
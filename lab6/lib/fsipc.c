@@ -15,13 +15,24 @@ extern uint8_t fsipcbuf[PGSIZE];	// page-aligned, declared in entry.S
 static int
 fsipc(unsigned type, void *fsreq, void *dstva, int *perm)
 {
-	envid_t whom;
-
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", env->env_id, type, fsipcbuf);
 
-	ipc_send(envs[1].env_id, type, fsreq, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(&whom, dstva, perm);
+	return ipc_call(envs[ENVX_FS].env_id, type, fsreq, PTE_P | PTE_W | PTE_U,
+			dstva, perm);
+}
+
+// Send a request small enough to travel in the IPC message words,
+// so that no request page is mapped into the file server and out again.
+// The words are laid out as the request's struct Fsreq_*.
+static int
+fsipc_words(unsigned type, uint32_t w1, uint32_t w2, uint32_t w3)
+{
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x %08x %08x\n", env->env_id, type,
+			w1, w2, w3);
+
+	return ipc_call_words(envs[ENVX_FS].env_id, type, w1, w2, w3);
 }
 
 // Send file-open request to the file server.
@@ -45,35 +56,26 @@ fsipc_open(const char *path, int omode, struct Fd *fd)
 }
 
 // Make a map-block request to the file server.
-// We send the fileid and the (byte) offset of the desired block in the file,
-// and the server sends us back a mapping for a page containing that block.
+// We send the fileid and the (byte) range [offset, offset+len) of the
+// desired blocks in the file, which must start on a block boundary,
+// and the server grants us the pages holding those blocks, all at once,
+// at dstva onwards.  Either every page is mapped or none is.
 // Returns 0 on success, < 0 on failure.
 int
-fsipc_map(int fileid, off_t offset, void *dstva)
+fsipc_map(int fileid, off_t offset, off_t len, void *dstva)
 {
-	int r, perm;
-	struct Fsreq_map *req;
+	int r;
 
-	req = (struct Fsreq_map*) fsipcbuf;
-	req->req_fileid = fileid;
-	req->req_offset = offset;
-	if ((r = fsipc(FSREQ_MAP, req, dstva, &perm)) < 0)
+	if ((r = sys_ipc_window(dstva, ROUNDUP(len, PGSIZE))) < 0)
 		return r;
-	if ((perm & ~(PTE_W | PTE_SHARE)) != (PTE_U | PTE_P))
-		panic("fsipc_map: unexpected permissions %08x for dstva %08x", perm, dstva);
-	return 0;
+	return fsipc_words(FSREQ_MAP, fileid, offset, len);
 }
 
 // Make a set-file-size request to the file server.
 int
 fsipc_set_size(int fileid, off_t size)
 {
-	struct Fsreq_set_size *req;
-
-	req = (struct Fsreq_set_size*) fsipcbuf;
-	req->req_fileid = fileid;
-	req->req_size = size;
-	return fsipc(FSREQ_SET_SIZE, req, 0, 0);
+	return fsipc_words(FSREQ_SET_SIZE, fileid, size, 0);
 }
 
 // Make a file-close request to the file server.
@@ -81,23 +83,14 @@ fsipc_set_size(int fileid, off_t size)
 int
 fsipc_close(int fileid)
 {
-	struct Fsreq_close *req;
-
-	req = (struct Fsreq_close*) fsipcbuf;
-	req->req_fileid = fileid;
-	return fsipc(FSREQ_CLOSE, req, 0, 0);
+	return fsipc_words(FSREQ_CLOSE, fileid, 0, 0);
 }
 
 // Ask the file server to mark a particular file block dirty.
 int
 fsipc_dirty(int fileid, off_t offset)
 {
-	struct Fsreq_dirty *req;
-
-	req = (struct Fsreq_dirty*) fsipcbuf;
-	req->req_fileid = fileid;
-	req->req_offset = offset;
-	return fsipc(FSREQ_DIRTY, req, 0, 0);
+	return fsipc_words(FSREQ_DIRTY, fileid, offset, 0);
 }
 
 // Ask the file server to delete a file, given its pathname.
@@ -118,6 +111,6 @@ fsipc_remove(const char *path)
 int
 fsipc_sync(void)
 {
-	return fsipc(FSREQ_SYNC, fsipcbuf, 0, 0);
+	return fsipc_words(FSREQ_SYNC, 0, 0, 0);
 }
 
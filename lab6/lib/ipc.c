@@ -40,12 +40,36 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	panic("ipc_recv: shouldn't reach here");
 }
 
+// Like ipc_recv, but give up and return -E_TIMEOUT if nothing arrives
+// within 'msec' milliseconds.  A 'msec' of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 unsigned msec)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+
+	if ((r = sys_ipc_recv_timeout(pg, msec)) < 0) {
+		if (perm_store)
+			*perm_store = 0;
+		if (from_env_store)
+			*from_env_store = 0;
+		return r;
+	}
+	if (perm_store)
+		*perm_store = env->env_ipc_perm;
+	if (from_env_store)
+		*from_env_store = env->env_ipc_from;
+	return env->env_ipc_value;
+}
+
 // Send 'val' (and 'pg' with 'perm', assuming 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the message.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -58,14 +82,87 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (pg == NULL)
 		pg = (void *) UTOP;
 
-	while (1)
-		if ((r=sys_ipc_try_send(to_env, val, pg, perm)) < 0) {
-			if (r != -E_IPC_NOT_RECV) 
-				panic("ipc_send: ipc send %e", r);
-			else
-				sys_yield();
-		} else {
-			return;
-		}
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
+		panic("ipc_send: ipc send %e", r);
 }
 
+
+// Fill in a received message's sender and page permission from 'env',
+// or with zeros if receiving failed with error r, and return its value.
+static int32_t
+ipc_received(int r, envid_t *from_env_store, int *perm_store)
+{
+	if (perm_store)
+		*perm_store = r < 0 ? 0 : env->env_ipc_perm;
+	if (from_env_store)
+		*from_env_store = r < 0 ? 0 : env->env_ipc_from;
+	return r < 0 ? r : env->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// and wait for its reply, which is received as by ipc_recv into
+// 'rcv_pg' and returned.  This is one system call where ipc_send
+// followed by ipc_recv is two, and 'to_env' runs right away if it is
+// waiting for requests.
+// Returns the reply's value, or < 0 if the call itself failed.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+
+	return ipc_received(sys_ipc_call(to_env, val, pg, perm, rcv_pg),
+			    NULL, perm_store);
+}
+
+// Like ipc_call, but send the words w1..w3 with 'val' instead of a
+// page; the receiver finds them in env_ipc_words.  No page comes back
+// with the reply either.
+int32_t
+ipc_call_words(envid_t to_env, uint32_t val, uint32_t w1, uint32_t w2,
+	       uint32_t w3)
+{
+	return ipc_received(sys_ipc_call_words(to_env, val, w1, w2, w3),
+			    NULL, NULL);
+}
+
+// The server side of ipc_call: reply to 'to_env' with 'val' (and 'pg'
+// with 'perm', if 'pg' is nonnull), then receive the next request as
+// ipc_recv does.  A client that is not receiving yet, such as one that
+// sent its request with ipc_send, gets the reply once it is.  A 'to_env'
+// of 0, or a client that has exited, gets none.
+// Returns the request's value, or < 0 if the reply was bad.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+
+	r = sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg);
+	if (r == -E_IPC_NOT_RECV && (r = sys_ipc_send(to_env, val, pg, perm)) == 0)
+		r = sys_ipc_recv(rcv_pg);
+	if (r == -E_BAD_ENV)
+		r = sys_ipc_recv(rcv_pg);
+	return ipc_received(r, from_env_store, perm_store);
+}
+
+// Receive between 1 and n messages from the endpoint 'epid' into 'msgs',
+// waiting for one to be posted if there are none.
+// Returns the number of messages received, or < 0 on error.
+int
+ep_recv(epid_t epid, struct Epmsg *msgs, unsigned n)
+{
+	int r;
+
+	while ((r = sys_ep_recv(epid, msgs, n)) == 0)
+		/* woken by a post; try again */;
+	return r;
+}
@@ -33,7 +33,8 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((vpd[PDX(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P)))
+		    || ((vpd[PDX(va)] & PTE_P)
+			&& ((vpt[VPN(va)] & PTE_P) || PTE_SWAPPED(vpt[VPN(va)]))))
 			return 0;
 	return 1;
 }
@@ -94,10 +95,12 @@ malloc(size_t n)
 
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * the pages are allocated lazily (PTE_COW): until it is written,
+	 * each maps the kernel's zero page and costs no memory.
 	 */
 	for (i = 0; i < n + 4; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
+		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|PTE_COW|cont) < 0){
 			for (; i >= 0; i -= PGSIZE)
 				sys_page_unmap(0, mptr + i);
 			return 0;	/* out of physical memory */
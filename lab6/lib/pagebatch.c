@@ -0,0 +1,65 @@
+// Batches of page operations, sent to the kernel with sys_page_batch
+// a batch at a time rather than with one system call each.
+
+#include <inc/lib.h>
+
+static void
+batch_add(struct Pagebatch *b, int type, envid_t envid, void *va,
+	  envid_t dstenvid, void *dstva, int perm)
+{
+	struct Pageop *op;
+	int r, max;
+
+	max = b->pb_max > 0 && b->pb_max < PAGEBATCH_MAX ? b->pb_max : PAGEBATCH_MAX;
+	if (b->pb_n == max && (r = batch_flush(b)) < 0
+	    && b->pb_err == 0)
+		b->pb_err = r;
+
+	op = &b->pb_ops[b->pb_n++];
+	op->op_type = type;
+	op->op_env = envid;
+	op->op_va = va;
+	op->op_dstenv = dstenvid;
+	op->op_dstva = dstva;
+	op->op_perm = perm;
+}
+
+// Queue the equivalent of sys_page_alloc(envid, va, perm).
+void
+batch_page_alloc(struct Pagebatch *b, envid_t envid, void *va, int perm)
+{
+	batch_add(b, PAGEOP_ALLOC, envid, va, 0, 0, perm);
+}
+
+// Queue the equivalent of sys_page_map(srcenvid, srcva, dstenvid, dstva, perm).
+void
+batch_page_map(struct Pagebatch *b, envid_t srcenvid, void *srcva,
+	       envid_t dstenvid, void *dstva, int perm)
+{
+	batch_add(b, PAGEOP_MAP, srcenvid, srcva, dstenvid, dstva, perm);
+}
+
+// Queue the equivalent of sys_page_unmap(envid, va).
+void
+batch_page_unmap(struct Pagebatch *b, envid_t envid, void *va)
+{
+	batch_add(b, PAGEOP_UNMAP, envid, va, 0, 0, 0);
+}
+
+// Do every operation queued on b, in order, and empty it.
+// Operations are also done whenever the batch fills up.
+// Returns 0 if all of them, since the last flush, succeeded;
+// otherwise the error of the first that failed.
+int
+batch_flush(struct Pagebatch *b)
+{
+	int r;
+
+	r = sys_page_batch(b->pb_ops, b->pb_n, NULL);
+	b->pb_n = 0;
+	if (b->pb_err < 0) {
+		r = b->pb_err;
+		b->pb_err = 0;
+	}
+	return r;
+}
@@ -22,6 +22,8 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	envid_t p_reader;	// last env to read, to yield to when full
+	envid_t p_writer;	// last env to write, to yield to when empty
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -121,6 +123,15 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Wait for the env at the other end of the pipe by giving it our CPU
+// time, or anyone else's if we don't know who it is.
+static void
+pipe_yield(envid_t other)
+{
+	if (other == 0 || sys_yield_to(other) < 0)
+		sys_yield();
+}
+
 static ssize_t
 piperead(struct Fd *fd, void *vbuf, size_t n, off_t offset)
 {
@@ -138,10 +149,11 @@ piperead(struct Fd *fd, void *vbuf, size_t n, off_t offset)
 	struct Pipe *p = (struct Pipe *) fd2data(fd);
 	int read_count = 0;
 
+	p->p_reader = env->env_id;
 	while (p->p_rpos >= p->p_wpos) {
 		if (_pipeisclosed(fd, p))
 			return 0;
-		sys_yield();
+		pipe_yield(p->p_writer);
 	}
 
 	while ((p->p_rpos < p->p_wpos) && (read_count < n)) {
@@ -167,11 +179,12 @@ pipewrite(struct Fd *fd, const void *vbuf, size_t n, off_t offset)
 	struct Pipe *p = (struct Pipe *) fd2data(fd);
 	int write_count = 0;
 
+	p->p_writer = env->env_id;
 	while (write_count < n) {
 		while ((p->p_wpos-p->p_rpos) >= PIPEBUFSIZ) {
 			if (_pipeisclosed(fd, p))
 				return 0;
-			sys_yield();
+			pipe_yield(p->p_reader);
 		}
 
 		p->p_buf[(uint32_t)p->p_wpos % PIPEBUFSIZ] = ((char *)vbuf)[write_count++];
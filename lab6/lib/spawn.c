@@ -9,6 +9,9 @@
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int copy_shared_pages(envid_t child);
 
+// Mappings for the child, sent to the kernel a batch at a time.
+static struct Pagebatch batch;
+
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
 // argv: pointer to null-terminated array of pointers to strings,
@@ -137,37 +140,46 @@ spawn(const char *prog, const char **argv)
 
 			if (ph->p_flags & ELF_PROG_FLAG_WRITE) {
 
+				if ((r=sys_page_alloc(0, (void *) UTEMP, PTE_U|PTE_P|PTE_W)) < 0)
+					return r;
 				for (i = 0; i < ph->p_memsz; i += PGSIZE) {
-					if ((r=sys_page_alloc(0, (void *) UTEMP, PTE_U|PTE_P|PTE_W)) < 0)
-						return r;
-					
-					if (i < ph->p_filesz) {
-						/*seek(fdnum, ph->p_offset+i);*/
-						seek(fdnum,aligned_offset+i);
+					if (i >= ph->p_filesz) {
+						// Pure bss: the child gets zeros
+						// when it first writes the page.
+						batch_page_alloc(&batch, child, (void *) (aligned_va+i), PTE_U|PTE_P|PTE_W|PTE_COW);
+						continue;
+					}
 
-						readsize = (ph->p_filesz-i >= PGSIZE) ? PGSIZE:(ph->p_filesz-i);
+					/*seek(fdnum, ph->p_offset+i);*/
+					seek(fdnum,aligned_offset+i);
 
-						read(fdnum,(void *) UTEMP, readsize);
+					readsize = (ph->p_filesz-i >= PGSIZE) ? PGSIZE:(ph->p_filesz-i);
 
-						// if the segment can full-fill the page, set tail section to 0x0
-						if (readsize < PGSIZE)
-							memset((void *) (UTEMP+readsize), 0x0, PGSIZE-readsize);
+					read(fdnum,(void *) UTEMP, readsize);
 
-					} else {
-						memset((void *) UTEMP, 0x0, PGSIZE);
-					}
+					// if the segment can full-fill the page, set tail section to 0x0
+					if (readsize < PGSIZE)
+						memset((void *) (UTEMP+readsize), 0x0, PGSIZE-readsize);
 
-					sys_page_map(0, UTEMP, child, (void *) (aligned_va+i), PTE_U|PTE_W|PTE_P);
-					sys_page_unmap(0, UTEMP);
+					// Give the page to the child, and get a
+					// fresh one for the next, in one system call.
+					batch_page_map(&batch, 0, UTEMP, child, (void *) (aligned_va+i), PTE_U|PTE_W|PTE_P);
+					batch_page_alloc(&batch, 0, UTEMP, PTE_U|PTE_P|PTE_W);
+					if ((r=batch_flush(&batch)) < 0)
+						return r;
 				}
+				if ((r=batch_flush(&batch)) < 0)
+					return r;
+				sys_page_unmap(0, UTEMP);
 
 			} else {
 				for (i = 0; i < ph->p_memsz; i+=PGSIZE) {
 					if ((r=read_map(fdnum, aligned_offset+i, &blk)) < 0)
 						return r;
-					if ((r=sys_page_map(0, blk, child, (void *) (aligned_va+i), PTE_U|PTE_P)) < 0)
-						return r;
+					batch_page_map(&batch, 0, blk, child, (void *) (aligned_va+i), PTE_U|PTE_P);
 				}
+				if ((r=batch_flush(&batch)) < 0)
+					return r;
 			}
 		}
 	}
@@ -181,18 +193,25 @@ spawn(const char *prog, const char **argv)
 		return r;
 
 	for (pdex = PDX(0); pdex < PDX(UTOP); pdex++) {
-		if (vpd[pdex] & PTE_P) {
+		// A superpage's flags are in its PDE; vpt[] shows its data.
+		if (vpd[pdex] & PTE_PS) {
+			if (vpd[pdex] & PTE_SHARE) {
+				va = (uintptr_t) PGADDR(pdex, 0, 0);
+				batch_page_map(&batch, 0, (void *) va, child, (void *) va, (vpd[pdex] & PTE_USER) | PTE_PS);
+			}
+		} else if (vpd[pdex] & PTE_P) {
 			for ( ptex = 0; ptex < NPTENTRIES; ptex++) {
 				pn = (pdex << 10) + ptex;
 
 				if ((vpt[pn] & PTE_P) && (vpt[pn] & PTE_SHARE)) {
 					va = (uintptr_t) PGADDR(pdex, ptex, 0);
-					if ((r=sys_page_map(0, (void *) va, child, (void *) va, vpt[pn] & PTE_USER)) < 0)
-						return r;
+					batch_page_map(&batch, 0, (void *) va, child, (void *) va, vpt[pn] & PTE_USER);
 				}
 			}
 		}
 	}
+	if ((r=batch_flush(&batch)) < 0)
+		return r;
 
 
 	return child;
@@ -287,9 +306,9 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// After completing the stack, map it into the child's address space
 	// and unmap it from ours!
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+	batch_page_map(&batch, 0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W);
+	batch_page_unmap(&batch, 0, UTEMP);
+	if ((r = batch_flush(&batch)) < 0)
 		goto error;
 
 	return 0;
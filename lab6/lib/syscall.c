@@ -79,6 +79,13 @@ sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 	return syscall(SYS_page_map, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
 }
 
+int
+sys_page_batch(const struct Pageop *ops, unsigned n, int *status)
+{
+	return syscall(SYS_page_batch, 0, (uint32_t) ops, n,
+		       (uint32_t) status, 0, 0);
+}
+
 int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -87,6 +94,30 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_memstat(envid_t envid, struct Envmem *em)
+{
+	return syscall(SYS_env_memstat, 1, envid, (uint32_t) em, 0, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_merge_stat(int on, struct Mergestat *ms)
+{
+	return syscall(SYS_merge_stat, 0, on, (uint32_t) ms, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -111,9 +142,111 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		   uint32_t w3)
+{
+	return syscall(SYS_ipc_call_words, 0, envid, value, w1, w2, w3);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, envid, value, (uint32_t) srcva,
+		       perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_window(void *va, size_t len)
+{
+	return syscall(SYS_ipc_window, 0, (uint32_t) va, len, 0, 0, 0);
+}
+
+int
+sys_ipc_grant(envid_t envid, uint32_t value, const struct Ipcgrant *grants,
+	      unsigned n)
+{
+	return syscall(SYS_ipc_grant, 0, envid, value, (uint32_t) grants, n, 0);
+}
+
+epid_t
+sys_ep_create(void)
+{
+	return syscall(SYS_ep_create, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ep_destroy(epid_t epid)
+{
+	return syscall(SYS_ep_destroy, 0, epid, 0, 0, 0, 0);
+}
+
+int
+sys_ep_post(epid_t epid, uint32_t value, uint32_t w1, uint32_t w2,
+	    uint32_t w3)
+{
+	return syscall(SYS_ep_post, 0, epid, value, w1, w2, w3);
+}
+
+int
+sys_ep_recv(epid_t epid, struct Epmsg *msgs, unsigned n)
+{
+	return syscall(SYS_ep_recv, 0, epid, (uint32_t) msgs, n, 0, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_timeout(void *dstva, unsigned msec)
+{
+	return syscall(SYS_ipc_recv, 0, (uint32_t)dstva, msec, 0, 0, 0);
+}
+
+
+int
+sys_env_set_priority(envid_t envid, uint32_t prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_shares(envid_t envid, uint32_t shares)
+{
+	return syscall(SYS_env_set_shares, 1, envid, shares, 0, 0, 0);
+}
+
+int
+sys_sleep(unsigned msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_yield_to(envid_t envid)
+{
+	return syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
+unsigned
+sys_time_msec(void)
+{
+	return (unsigned) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+}
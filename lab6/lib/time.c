@@ -0,0 +1,37 @@
+// Reading the kernel's clock.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Nanoseconds since boot.
+// Computed from the TSC and the time page at UTIME, without entering
+// the kernel, unless the kernel has not calibrated the TSC.
+uint64_t
+time_nsec(void)
+{
+	uint32_t seq, mult, shift;
+	uint64_t boot, delta;
+
+	do {
+		seq = vtime.tp_seq;
+		mult = vtime.tp_mult;
+		shift = vtime.tp_shift;
+		boot = vtime.tp_boot_tsc;
+	} while ((seq & 1) || seq != vtime.tp_seq);
+
+	if (mult == 0)
+		return (uint64_t) sys_time_msec() * 1000000;
+
+	// delta * mult needs up to 96 bits, so multiply the halves
+	// of delta separately.
+	delta = read_tsc() - boot;
+	return (((delta >> 32) * mult) << (32 - shift))
+		+ (((delta & 0xFFFFFFFF) * mult) >> shift);
+}
+
+// Milliseconds since boot.
+uint64_t
+time_msec(void)
+{
+	return time_nsec() / 1000000;
+}
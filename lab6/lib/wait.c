@@ -9,5 +9,5 @@ wait(envid_t envid)
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
 	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+		sys_env_wait(envid);
 }
@@ -0,0 +1,82 @@
+// Time fork with a large address space, and compare mapping its pages
+// one system call at a time with mapping them through sys_page_batch:
+// first on their own, then as part of a user-level fork.
+
+#include <inc/lib.h>
+
+#define NPAGES	512		// 2MB of data
+#define NFORK	10
+#define BENCHVA	((char *) 0x10000000)
+
+static struct Pagebatch batch;
+
+// Create a child that never runs, just to map pages into.
+static envid_t
+scratch_child(void)
+{
+	envid_t id;
+
+	if ((id = sys_exofork()) < 0)
+		panic("sys_exofork: %e", id);
+	if (id == 0)
+		panic("scratch child ran");
+	return id;
+}
+
+// Time NFORK forks, each with a child that exits at once.
+static void
+time_fork(const char *what, envid_t (*forkfn)(void))
+{
+	uint64_t start;
+	envid_t id;
+	int i;
+
+	start = time_nsec();
+	for (i = 0; i < NFORK; i++) {
+		if ((id = forkfn()) < 0)
+			panic("%s: %e", what, id);
+		if (id == 0)
+			exit();
+		wait(id);
+	}
+	cprintf("%s: %u us each\n", what,
+		(uint32_t) ((time_nsec() - start) / 1000 / NFORK));
+}
+
+void
+umain(void)
+{
+	uint64_t start;
+	envid_t id;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, BENCHVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	id = scratch_child();
+	start = time_nsec();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_map(0, BENCHVA + i * PGSIZE, id,
+				      BENCHVA + i * PGSIZE, PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	cprintf("sys_page_map: %u pages in %u us\n", NPAGES,
+		(uint32_t) ((time_nsec() - start) / 1000));
+	sys_env_destroy(id);
+
+	id = scratch_child();
+	start = time_nsec();
+	for (i = 0; i < NPAGES; i++)
+		batch_page_map(&batch, 0, BENCHVA + i * PGSIZE, id,
+			       BENCHVA + i * PGSIZE, PTE_P|PTE_U);
+	if ((r = batch_flush(&batch)) < 0)
+		panic("batch_flush: %e", r);
+	cprintf("sys_page_batch: %u pages in %u us\n", NPAGES,
+		(uint32_t) ((time_nsec() - start) / 1000));
+	sys_env_destroy(id);
+
+	time_fork("ufork, unbatched", ufork_unbatched);
+	time_fork("ufork, batched", ufork);
+	time_fork("fork", fork);
+}
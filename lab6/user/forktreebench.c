@@ -0,0 +1,56 @@
+// Fork a binary tree of processes, first with the single-system-call
+// fork and then with the user-level one, and time each.
+
+#include <inc/lib.h>
+
+#define DEPTH	4
+#define NPAGES	256		// 1MB of data for every node to copy
+#define BENCHVA	((char *) 0x10000000)
+
+static envid_t (*forkfn)(void);
+
+static void
+forktree(int depth)
+{
+	envid_t kids[2];
+	int i;
+
+	if (depth == DEPTH)
+		return;
+	for (i = 0; i < 2; i++) {
+		if ((kids[i] = forkfn()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			forktree(depth + 1);
+			exit();
+		}
+	}
+	for (i = 0; i < 2; i++)
+		wait(kids[i]);
+}
+
+static void
+bench(const char *name, envid_t (*fn)(void))
+{
+	uint64_t start;
+
+	forkfn = fn;
+	start = time_nsec();
+	forktree(0);
+	cprintf("%s: %u processes in %u us\n", name, (1 << (DEPTH + 1)) - 2,
+		(uint32_t) ((time_nsec() - start) / 1000));
+}
+
+void
+umain(void)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, BENCHVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	bench("sys_fork", fork);
+	bench("ufork", ufork);
+}
@@ -0,0 +1,63 @@
+// Time IPC round trips to an echo server: first as separate
+// send and receive calls, then with ipc_call and ipc_reply_recv.
+
+#include <inc/lib.h>
+
+#define NROUND	10000
+
+static void
+server(void)
+{
+	envid_t who;
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < NROUND; i++) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+
+	v = ipc_recv(&who, 0, 0);
+	for (i = 1; i < NROUND; i++)
+		v = ipc_reply_recv(who, v + 1, 0, 0, &who, 0, 0);
+	ipc_send(who, v + 1, 0, 0);
+}
+
+static void
+report(const char *what, uint64_t start)
+{
+	uint64_t ns = time_nsec() - start;
+
+	cprintf("%s: %u rounds, %u ns/round\n", what, NROUND,
+		(uint32_t) (ns / NROUND));
+}
+
+void
+umain(void)
+{
+	envid_t id;
+	uint64_t start;
+	uint32_t v;
+	int i;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		server();
+		return;
+	}
+
+	start = time_nsec();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(id, i, 0, 0);
+		if ((v = ipc_recv(0, 0, 0)) != i + 1)
+			panic("send/recv: got %d, want %d", v, i + 1);
+	}
+	report("send/recv", start);
+
+	start = time_nsec();
+	for (i = 0; i < NROUND; i++)
+		if ((v = ipc_call(id, i, 0, 0, 0, 0)) != i + 1)
+			panic("call: got %d, want %d", v, i + 1);
+	report("call/reply_recv", start);
+}
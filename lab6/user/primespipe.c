@@ -4,9 +4,9 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENVS is 1024, we can print 1022 primes before running out.
-// The remaining two environments are the integer generator at the bottom
-// of main and user/idle.
+// Each prime takes an environment, and there are NENV of them, less the
+// integer generator at the bottom of main and the file server; in
+// practice physical memory runs out before environments do.
 
 #include <inc/lib.h>
 
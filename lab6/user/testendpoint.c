@@ -0,0 +1,70 @@
+// Check that posts to an endpoint queue up without blocking, in order,
+// until its ring is full, and that the owner can drain it in batches.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NMSG	50
+
+void
+umain(void)
+{
+	struct Epmsg msgs[EP_RING];
+	envid_t kids[NCHILD];
+	uint32_t next[NCHILD];
+	epid_t ep;
+	int i, j, n, r, total;
+
+	if ((ep = sys_ep_create()) < 0)
+		panic("sys_ep_create: %e", ep);
+
+	// Fill the ring ourselves, then take it all back in one call.
+	for (i = 0; i < EP_RING; i++)
+		if ((r = sys_ep_post(ep, i, i + 1, i + 2, i + 3)) < 0)
+			panic("sys_ep_post %d: %e", i, r);
+	if ((r = sys_ep_post(ep, EP_RING, 0, 0, 0)) != -E_EP_FULL)
+		panic("post to full endpoint: got %e, want %e", r, -E_EP_FULL);
+	if ((n = ep_recv(ep, msgs, EP_RING)) != EP_RING)
+		panic("ep_recv: got %d messages, want %d", n, EP_RING);
+	for (i = 0; i < EP_RING; i++)
+		if (msgs[i].m_from != env->env_id || msgs[i].m_value != i
+		    || msgs[i].m_words[0] != i + 1 || msgs[i].m_words[2] != i + 3)
+			panic("message %d garbled", i);
+
+	// Children post without waiting for us; they retry when the
+	// ring is full.
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			for (j = 0; j < NMSG; j++)
+				while ((r = sys_ep_post(ep, i * NMSG + j, i, 0, 0)) < 0) {
+					if (r != -E_EP_FULL)
+						panic("sys_ep_post: %e", r);
+					sys_yield();
+				}
+			return;
+		}
+		next[i] = 0;
+	}
+
+	for (total = 0; total < NCHILD * NMSG; total += n) {
+		if ((n = ep_recv(ep, msgs, EP_RING)) < 0)
+			panic("ep_recv: %e", n);
+		for (j = 0; j < n; j++) {
+			i = msgs[j].m_words[0];
+			if (i >= NCHILD || msgs[j].m_from != kids[i])
+				panic("message from unknown env %08x", msgs[j].m_from);
+			if (msgs[j].m_value != i * NMSG + next[i])
+				panic("child %d: got %d, want %d", i,
+				      msgs[j].m_value, i * NMSG + next[i]);
+			next[i]++;
+		}
+	}
+
+	if ((r = sys_ep_destroy(ep)) < 0)
+		panic("sys_ep_destroy: %e", r);
+	if ((r = sys_ep_post(ep, 0, 0, 0, 0)) != -E_INVAL)
+		panic("post to destroyed endpoint: got %e, want %e", r, -E_INVAL);
+	cprintf("endpoint OK\n");
+}
@@ -0,0 +1,42 @@
+// Check that senders block in the kernel until the receiver is ready,
+// and that each sender's messages arrive in order.
+
+#include <inc/lib.h>
+
+#define NCHILD	8
+#define NMSG	10
+
+void
+umain(void)
+{
+	envid_t parent, kids[NCHILD], who;
+	uint32_t next[NCHILD];
+	int i, j, v;
+
+	parent = sys_getenvid();
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			for (j = 0; j < NMSG; j++)
+				ipc_send(parent, i * NMSG + j, 0, 0);
+			return;
+		}
+		next[i] = 0;
+	}
+
+	// Let every child block on our queue before we start receiving.
+	sys_sleep(50);
+
+	for (j = 0; j < NCHILD * NMSG; j++) {
+		v = ipc_recv(&who, 0, 0);
+		for (i = 0; i < NCHILD && kids[i] != who; i++)
+			/* do nothing */;
+		if (i == NCHILD)
+			panic("message %d from unknown env %08x", v, who);
+		if (v != i * NMSG + next[i])
+			panic("child %d: got %d, want %d", i, v, i * NMSG + next[i]);
+		next[i]++;
+	}
+	cprintf("ipc send queue OK\n");
+}
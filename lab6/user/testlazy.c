@@ -0,0 +1,91 @@
+// Test lazily allocated memory: pages that map the zero page until
+// they are first written, both from sys_page_alloc and in the bss.
+// Also map more lazy pages than a 16-bit reference count could hold,
+// and check that the zero page stays zero.
+
+#include <inc/lib.h>
+
+#define NPAGES	1024		// 4MB
+#define NBSS	256
+#define LAZYVA	((char *) 0x20000000)
+#define NWRAP	(65536 + 16)
+#define WRAPVA	((char *) 0x30000000)
+
+static char bss[NBSS * PGSIZE];
+static struct Pagebatch batch;
+
+static struct Envmem
+memstat(void)
+{
+	struct Envmem m;
+	int r;
+
+	if ((r = sys_env_memstat(0, &m)) < 0)
+		panic("sys_env_memstat: %e", r);
+	return m;
+}
+
+void
+umain(void)
+{
+	struct Envmem m0, m;
+	int i, r;
+
+	m0 = memstat();
+	cprintf("start: %u pages committed, %u resident\n",
+		m0.em_committed, m0.em_resident);
+	if (m0.em_committed - m0.em_resident < NBSS - 1)
+		panic("bss is resident: %u of %u pages",
+		      m0.em_resident, m0.em_committed);
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, LAZYVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_COW)) < 0)
+			panic("sys_page_alloc: %e", r);
+	m = memstat();
+	if (m.em_committed != m0.em_committed + NPAGES
+	    || m.em_resident != m0.em_resident)
+		panic("lazy alloc: %u committed, %u resident",
+		      m.em_committed, m.em_resident);
+
+	// Reading costs nothing...
+	for (i = 0; i < NPAGES; i++)
+		if (LAZYVA[i * PGSIZE + i % PGSIZE] != 0)
+			panic("page %d is not zero", i);
+	if (memstat().em_resident != m0.em_resident)
+		panic("reading made pages resident");
+
+	// ...and each page written costs one page.
+	for (i = 0; i < NPAGES; i += 16)
+		LAZYVA[i * PGSIZE] = i;
+	for (i = 0; i < NBSS; i += 16)
+		bss[i * PGSIZE] = i;
+	m = memstat();
+	cprintf("written: %u pages committed, %u resident\n",
+		m.em_committed, m.em_resident);
+	if (m.em_resident > m0.em_resident + NPAGES / 16 + NBSS / 16)
+		panic("too many pages resident");
+	for (i = 0; i < NPAGES; i += 16)
+		if (LAZYVA[i * PGSIZE] != (char) i || LAZYVA[i * PGSIZE + 1] != 0
+		    || LAZYVA[(i + 1) * PGSIZE] != 0)
+			panic("page %d has the wrong contents", i);
+
+	for (i = 0; i < NWRAP; i++)
+		batch_page_alloc(&batch, 0, WRAPVA + i * PGSIZE,
+				 PTE_P|PTE_U|PTE_W|PTE_COW);
+	if ((r = batch_flush(&batch)) < 0)
+		panic("batch_flush: %e", r);
+	if ((uint32_t) pageref(WRAPVA) <= NWRAP)
+		panic("zero page has only %d references", pageref(WRAPVA));
+	WRAPVA[0] = 1;
+	if (WRAPVA[PGSIZE] != 0 || LAZYVA[PGSIZE] != 0 || bss[PGSIZE] != 0)
+		panic("writing a lazy page changed the zero page");
+	for (i = 0; i < NWRAP; i++)
+		batch_page_unmap(&batch, 0, WRAPVA + i * PGSIZE);
+	if ((r = batch_flush(&batch)) < 0)
+		panic("batch_flush: %e", r);
+	if (LAZYVA[PGSIZE] != 0)
+		panic("unmapping lazy pages freed the zero page");
+
+	cprintf("testlazy: OK\n");
+}
@@ -0,0 +1,37 @@
+// Test that the env table grows past its old limit of 1024: keep more
+// environments than that alive at once.
+
+#include <inc/lib.h>
+
+#define NKIDS	2000
+
+static envid_t kids[NKIDS];
+
+void
+umain(void)
+{
+	int i, maxx;
+
+	maxx = 0;
+	for (i = 0; i < NKIDS; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork %d: %e", i, kids[i]);
+		if (kids[i] == 0) {
+			ipc_recv(0, 0, 0);
+			exit();
+		}
+		if (ENVX(kids[i]) > maxx)
+			maxx = ENVX(kids[i]);
+		if (envs[ENVX(kids[i])].env_id != kids[i])
+			panic("envs[] does not show child %08x", kids[i]);
+	}
+	cprintf("%d children alive, highest index %d\n", NKIDS, maxx);
+	if (maxx < NKIDS)
+		panic("highest index %d is too low", maxx);
+
+	for (i = 0; i < NKIDS; i++) {
+		ipc_send(kids[i], 0, 0, 0);
+		wait(kids[i]);
+	}
+	cprintf("testmanyenvs: OK\n");
+}
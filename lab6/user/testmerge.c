@@ -0,0 +1,135 @@
+// Test same-page merging: two children fill pages with the same
+// contents, and after a pass each page should be one shared frame,
+// copy-on-write.  Then one child writes to a page, and should get a
+// copy of its own while the other's stays as it was.
+
+#include <inc/lib.h>
+
+#define NPAGES		16
+#define MERGEVA		((char *) 0x10000000)
+#define MAXWAIT		100		// Times 100ms
+
+// What the parent tells a child to do.
+enum { CHECK_MERGED = 1, WRITE, CHECK_UNCHANGED, EXIT };
+
+static struct Mergestat
+mergestat(int on)
+{
+	struct Mergestat ms;
+	int r;
+
+	if ((r = sys_merge_stat(on, &ms)) < 0)
+		panic("sys_merge_stat: %e", r);
+	return ms;
+}
+
+static void
+fill(void)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, MERGEVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(MERGEVA + i * PGSIZE, i + 1, PGSIZE);
+	}
+}
+
+static void
+check_contents(int i, char c)
+{
+	char *p = MERGEVA + i * PGSIZE;
+
+	if (p[0] != c || p[PGSIZE / 2] != c || p[PGSIZE - 1] != c)
+		panic("page %d has the wrong contents: %02x", i, p[0] & 0xFF);
+}
+
+static void
+child(void)
+{
+	envid_t parent = env->env_parent_id;
+	int i;
+
+	fill();
+	ipc_send(parent, 0, 0, 0);
+	for (;;) {
+		switch (ipc_recv(0, 0, 0)) {
+		case CHECK_MERGED:
+			for (i = 0; i < NPAGES; i++) {
+				check_contents(i, i + 1);
+				if (pageref(MERGEVA + i * PGSIZE) < 2)
+					panic("page %d was not merged", i);
+				if ((vpt[VPN(MERGEVA + i * PGSIZE)]
+				     & (PTE_W | PTE_COW)) != PTE_COW)
+					panic("merged page %d is not "
+					      "copy-on-write", i);
+			}
+			break;
+		case WRITE:
+			MERGEVA[0] = 0x55;
+			if (pageref(MERGEVA) != 1)
+				panic("written page is still shared");
+			check_contents(0, 0x55);
+			break;
+		case CHECK_UNCHANGED:
+			check_contents(0, 1);
+			break;
+		case EXIT:
+			return;
+		}
+		ipc_send(parent, 0, 0, 0);
+	}
+}
+
+static void
+tell(envid_t id, int what)
+{
+	ipc_send(id, what, 0, 0);
+	ipc_recv(0, 0, 0);
+}
+
+void
+umain(void)
+{
+	struct Mergestat ms0, ms;
+	envid_t kids[2];
+	int i;
+
+	ms0 = mergestat(1);
+	for (i = 0; i < 2; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			child();
+			exit();
+		}
+		ipc_recv(0, 0, 0);
+	}
+
+	// Wait for a whole pass to start and end after the pages were
+	// filled in.
+	ms = mergestat(-1);
+	for (i = 0; i < MAXWAIT; i++) {
+		sys_sleep(100);
+		if (mergestat(-1).ms_npass >= ms.ms_npass + 2)
+			break;
+	}
+	ms = mergestat(ms0.ms_on);
+	if (i == MAXWAIT)
+		panic("no merging pass after %d ms", MAXWAIT * 100);
+	cprintf("%u pages scanned, %u merged\n",
+		ms.ms_nscan - ms0.ms_nscan, ms.ms_nmerged - ms0.ms_nmerged);
+	if (ms.ms_nmerged - ms0.ms_nmerged < NPAGES)
+		panic("only %u pages merged", ms.ms_nmerged - ms0.ms_nmerged);
+
+	tell(kids[0], CHECK_MERGED);
+	tell(kids[1], CHECK_MERGED);
+	tell(kids[0], WRITE);
+	tell(kids[1], CHECK_UNCHANGED);
+	for (i = 0; i < 2; i++) {
+		ipc_send(kids[i], EXIT, 0, 0);
+		wait(kids[i]);
+	}
+	cprintf("testmerge: OK\n");
+}
@@ -0,0 +1,68 @@
+// Check that sys_sleep, a timed ipc_recv and wait block for at least as
+// long as they should, and that a value sent in time beats the timeout.
+
+#include <inc/lib.h>
+
+static void
+check(const char *what, int r, int want)
+{
+	if (r != want)
+		panic("%s: got %d, want %d", what, r, want);
+}
+
+// Check that at least 'min' msec have passed since 'start'.
+static void
+check_elapsed(const char *what, unsigned start, unsigned min)
+{
+	unsigned elapsed = sys_time_msec() - start;
+
+	cprintf("%s took %u msec\n", what, elapsed);
+	if (elapsed < min)
+		panic("%s returned after %u msec, want at least %u",
+		      what, elapsed, min);
+}
+
+void
+umain(void)
+{
+	envid_t who, parent;
+	unsigned start;
+	int r;
+
+	cprintf("sleeping 50 msec\n");
+	start = sys_time_msec();
+	check("sys_sleep", sys_sleep(50), 0);
+	check_elapsed("sys_sleep", start, 50);
+
+	cprintf("receiving with a 50 msec timeout\n");
+	start = sys_time_msec();
+	check("ipc_recv_timeout", ipc_recv_timeout(0, 0, 0, 50), -E_TIMEOUT);
+	check_elapsed("ipc_recv_timeout", start, 50);
+
+	parent = sys_getenvid();
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		sys_sleep(20);
+		ipc_send(parent, 42, 0, 0);
+		return;
+	}
+	r = ipc_recv_timeout(&who, 0, 0, 5000);
+	check("ipc_recv_timeout", r, 42);
+
+	// wait blocks until a child that sleeps has exited.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		sys_sleep(100);
+		return;
+	}
+	start = sys_time_msec();
+	wait(who);
+	check_elapsed("wait", start, 100);
+	if (envs[ENVX(who)].env_id == who
+	    && envs[ENVX(who)].env_status != ENV_FREE)
+		panic("wait returned before the child exited");
+
+	cprintf("sleep OK\n");
+}
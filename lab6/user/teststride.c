@@ -0,0 +1,57 @@
+// Check that the stride scheduler divides the CPU among spinning
+// environments in proportion to their shares, including a share above
+// the 100 ordinary environments once started with, and that an
+// environment cannot raise its own shares.
+
+#include <inc/lib.h>
+
+#define NCHILD		4
+#define NYIELD		400
+#define COUNTS		((volatile uint32_t *) 0xA0000000)
+
+static uint32_t shares[NCHILD] = { 25, 50, 75, 400 };
+
+void
+umain(void)
+{
+	envid_t kids[NCHILD];
+	int i, r, ok;
+	uint32_t base, pct;
+
+	if ((r = sys_page_alloc(0, (void *) COUNTS, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			if ((r = sys_env_set_shares(0, shares[i])) < 0)
+				panic("sys_env_set_shares: %e", r);
+			if ((r = sys_env_set_shares(0, shares[i] + 1)) != -E_INVAL)
+				panic("raised own shares: %e", r);
+			while (1)
+				COUNTS[i]++;
+		}
+		kids[i] = r;
+	}
+
+	// Let the children compete for a while.
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+
+	for (i = 0; i < NCHILD; i++)
+		sys_env_destroy(kids[i]);
+
+	ok = 1;
+	base = COUNTS[0] / shares[0];
+	for (i = 0; i < NCHILD; i++) {
+		// Percentage of the CPU this child got, relative to what
+		// the first child got per share.
+		pct = base ? COUNTS[i] / shares[i] * 100 / base : 0;
+		cprintf("child %d: shares %d count %u (%u%% of fair)\n",
+			i, shares[i], COUNTS[i], pct);
+		if (pct < 80 || pct > 120)
+			ok = 0;
+	}
+	cprintf("stride scheduling %s\n", ok ? "OK" : "BROKEN");
+}
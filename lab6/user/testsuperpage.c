@@ -0,0 +1,58 @@
+// Test 4MB superpages: allocation, copy-on-write across fork, and
+// unmapping.
+
+#include <inc/lib.h>
+
+#define SUPERVA	((char *) 0x40000000)
+
+void
+umain(void)
+{
+	struct Envmem m0, m;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_env_memstat(0, &m0)) < 0)
+		panic("sys_env_memstat: %e", r);
+	if ((r = sys_page_alloc(0, SUPERVA + PGSIZE, PTE_P|PTE_U|PTE_W|PTE_PS)) != -E_INVAL)
+		panic("unaligned superpage: got %e", r);
+	if ((r = sys_page_alloc(0, SUPERVA, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(vpd[PDX(SUPERVA)] & PTE_PS))
+		panic("not a superpage: pde %08x", vpd[PDX(SUPERVA)]);
+	sys_env_memstat(0, &m);
+	if (m.em_resident != m0.em_resident + NPTENTRIES)
+		panic("memstat: %u resident, expected %u",
+		      m.em_resident, m0.em_resident + NPTENTRIES);
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (SUPERVA[i] != 0 || SUPERVA[i + PGSIZE - 1] != 0)
+			panic("superpage is not zero at %x", i);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		SUPERVA[i] = i / PGSIZE;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (SUPERVA[i] != (char) (i / PGSIZE))
+				panic("child: wrong contents at %x", i);
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			SUPERVA[i] = ~(i / PGSIZE);
+		if (!(vpd[PDX(SUPERVA)] & PTE_W))
+			panic("child: superpage still read-only");
+		exit();
+	}
+	wait(child);
+
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (SUPERVA[i] != (char) (i / PGSIZE))
+			panic("child's write reached the parent at %x", i);
+
+	if ((r = sys_page_unmap(0, SUPERVA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (vpd[PDX(SUPERVA)] & PTE_P)
+		panic("superpage still mapped");
+
+	cprintf("testsuperpage: OK\n");
+}
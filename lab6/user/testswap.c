@@ -0,0 +1,98 @@
+// Test demand paging: touch more memory than the machine has, and check
+// that pages come back from swap intact, in a forked child that shares
+// them too, and that unmapping pages that are swapped out lets go of
+// them.
+
+#include <inc/lib.h>
+
+#define SWAPVA		((char *) 0x10000000)
+#define MAXPAGES	49152		// 192MB
+#define NOUT		2048		// Pages to see swapped out
+
+static struct Envmem
+memstat(void)
+{
+	struct Envmem m;
+	int r;
+
+	if ((r = sys_env_memstat(0, &m)) < 0)
+		panic("sys_env_memstat: %e", r);
+	return m;
+}
+
+static uint32_t
+nout(struct Envmem m0)
+{
+	struct Envmem m = memstat();
+
+	return (m.em_committed - m.em_resident)
+		- (m0.em_committed - m0.em_resident);
+}
+
+static void
+check(int n, int step)
+{
+	uint32_t *p;
+	int i;
+
+	for (i = 0; i < n; i += step) {
+		p = (uint32_t *) (SWAPVA + i * PGSIZE);
+		if (p[0] != i || p[PGSIZE / 4 - 1] != ~i)
+			panic("page %d has the wrong contents: %x %x",
+			      i, p[0], p[PGSIZE / 4 - 1]);
+	}
+}
+
+void
+umain(void)
+{
+	struct Envmem m0;
+	uint32_t *p;
+	envid_t child;
+	int i, n, r;
+
+	m0 = memstat();
+	for (n = 0; n < MAXPAGES; n++) {
+		if (n % 256 == 0 && nout(m0) >= NOUT)
+			break;
+		if ((r = sys_page_alloc(0, SWAPVA + n * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc after %d pages: %e", n, r);
+		p = (uint32_t *) (SWAPVA + n * PGSIZE);
+		p[0] = n;
+		p[PGSIZE / 4 - 1] = ~n;
+	}
+	if (n == MAXPAGES)
+		panic("%d pages written, but only %u swapped out",
+		      n, nout(m0));
+	cprintf("%d pages written, %u swapped out\n", n, nout(m0));
+
+	// Reading them all back pages the others out, twice over.
+	check(n, 1);
+	check(n, 1);
+	cprintf("%d pages read back, %u swapped out\n", n, nout(m0));
+
+	// A child shares the pages, through the same page tables.  There
+	// are more of them than memory, so reading them all through the
+	// child has to page out frames that both map, and the parent
+	// still finds them all after.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		check(n, 1);
+		check(n, 1);
+		cprintf("%d pages read back in a child\n", n);
+		exit();
+	}
+	wait(child);
+	check(n, 1);
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_unmap(0, SWAPVA + i * PGSIZE)) < 0)
+			panic("sys_page_unmap: %e", r);
+	if (memstat().em_committed != m0.em_committed)
+		panic("%u pages still committed, expected %u",
+		      memstat().em_committed, m0.em_committed);
+
+	cprintf("testswap: OK\n");
+}
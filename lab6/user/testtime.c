@@ -0,0 +1,29 @@
+// Check that the time page agrees with sys_time_msec,
+// and that both advance across a sleep.
+
+#include <inc/lib.h>
+
+void
+umain(void)
+{
+	uint64_t t0, t1;
+	unsigned k0, k1;
+	int32_t d;
+
+	cprintf("TSC %u kHz\n", vtime.tp_tsc_khz);
+
+	t0 = time_msec();
+	k0 = sys_time_msec();
+	sys_sleep(100);
+	t1 = time_msec();
+	k1 = sys_time_msec();
+
+	cprintf("slept %u msec by the time page, %u by sys_time_msec\n",
+		(uint32_t) (t1 - t0), k1 - k0);
+
+	d = (int32_t) (t1 - k1);
+	if (t1 - t0 < 100 || k1 - k0 < 100 || d < -2 || d > 2)
+		panic("clocks disagree: time page %u, kernel %u",
+		      (uint32_t) t1, k1);
+	cprintf("time OK\n");
+}